@@ -1,4 +1,10 @@
 #include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <string>
+#include "gauss_batch.h"
 using namespace std;
 // Вывод системы уравнений
 void sysout(double **a, double *y, int n)
@@ -76,12 +82,91 @@ double * gauss(double **a, double *y, int n)
   }
   return x;
 }
-int main() 
+// Сравнение gauss_batch с вызовом gauss() в цикле на count случайных системах размера n.
+// Сборка: g++ -O2 equation.cpp gauss_batch.cpp
+int benchmark(int n, int count)
+{
+  if (n < 1 || count < 1)
+  {
+    cout << "Использование: equation --benchmark n count" << endl;
+    return 1;
+  }
+  mt19937 random(1);
+  uniform_real_distribution<double> value(-1, 1);
+  size_t systems = count;
+  double *a = new double[size_t(n) * n * systems], *y = new double[size_t(n) * systems];
+  for (size_t s = 0; s < systems; s++)
+    for (size_t i = 0; i < size_t(n); i++)
+    {
+      for (size_t j = 0; j < size_t(n); j++)
+        a[(i * n + j) * systems + s] = value(random) + (i == j ? n : 0);
+      y[i * systems + s] = value(random);
+    }
+
+  // копии для gauss(), который работает со строками double*
+  double ***rows = new double**[count], **right = new double*[count];
+  for (size_t s = 0; s < systems; s++)
+  {
+    rows[s] = new double*[n];
+    right[s] = new double[n];
+    for (size_t i = 0; i < size_t(n); i++)
+    {
+      rows[s][i] = new double[n];
+      for (size_t j = 0; j < size_t(n); j++)
+        rows[s][i][j] = a[(i * n + j) * systems + s];
+      right[s][i] = y[i * systems + s];
+    }
+  }
+  double *x = new double[size_t(n) * systems];
+  bool *singular = new bool[count];
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  gauss_batch(a, y, x, singular, n, count);
+  double batch_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  double difference = 0;
+  start = chrono::steady_clock::now();
+  double **solutions = new double*[count];
+  for (int s = 0; s < count; s++)
+    solutions[s] = gauss(rows[s], right[s], n);
+  double loop_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  for (size_t s = 0; s < systems; s++)
+    for (size_t i = 0; i < size_t(n) && solutions[s]; i++)
+      difference = fmax(difference, fabs(solutions[s][i] - x[i * systems + s]));
+
+  cout << "Системы " << n << "x" << n << ", " << count << " шт." << endl;
+  cout << "gauss() в цикле: " << loop_time << " с" << endl;
+  cout << "gauss_batch():   " << batch_time << " с" << endl;
+  cout << "Максимальное расхождение решений: " << difference << endl;
+
+  for (int s = 0; s < count; s++)
+  {
+    for (int i = 0; i < n; i++)
+      delete[] rows[s][i];
+    delete[] rows[s];
+    delete[] right[s];
+    delete[] solutions[s];
+  }
+  delete[] rows;
+  delete[] right;
+  delete[] solutions;
+  delete[] a;
+  delete[] y;
+  delete[] x;
+  delete[] singular;
+  return 0;
+}
+
+int main(int argc, char *argv[]) 
 {
   double **a, *y, *x;
   int n;
+  if (argc == 4 && string(argv[1]) == "--benchmark")
+    return benchmark(atoi(argv[2]), atoi(argv[3]));
+#ifdef _WIN32
   system("chcp 1251");
   system("cls");
+#endif
   cout << "Введите количество уравнений: ";
   cin >> n;
   a = new double*[n];
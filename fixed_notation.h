@@ -0,0 +1,11 @@
+#ifndef FIXED_NOTATION_H
+#define FIXED_NOTATION_H
+
+#include <cstddef>
+
+// Longest text std::to_chars gives for a double in fixed notation with 6 decimals: a sign,
+// the 309 integer digits of DBL_MAX, the point and the decimals. The buffered text writers
+// flush while at least a line of such values still fits, so a value is never cut short.
+const std::size_t FIXED6_MAX_CHARS = 317;
+
+#endif
@@ -0,0 +1,82 @@
+#include <cmath>
+#include "gauss_batch.h"
+using namespace std;
+// Во внутренних циклах соседние ячейки памяти принадлежат разным системам, поэтому
+// компилятор раскладывает их по SIMD-регистрам. Смещения считаются в size_t: n * n * count
+// легко выходит за int.
+const size_t BATCH_TILE = 256; // столько систем обрабатывается за проход, чтобы данные оставались в кэше
+
+void gauss_batch(double *a, double *y, double *x, bool *singular, size_t n, size_t count)
+{
+  const double eps = 0.00001;  // точность, как в gauss()
+  double factor[BATCH_TILE], pivot[BATCH_TILE];
+  size_t index[BATCH_TILE];
+  for (size_t first = 0; first < count; first += BATCH_TILE)
+  {
+    size_t last = first + BATCH_TILE < count ? first + BATCH_TILE : count;
+    for (size_t s = first; s < last; s++)
+      singular[s] = false;
+    for (size_t k = 0; k < n; k++)
+    {
+      // Поиск строки с максимальным a[i][k] отдельно для каждой системы
+      for (size_t s = first; s < last; s++)
+      {
+        pivot[s - first] = fabs(a[(k * n + k) * count + s]);
+        index[s - first] = k;
+      }
+      for (size_t i = k + 1; i < n; i++)
+        for (size_t s = first; s < last; s++)
+        {
+          double value = fabs(a[(i * n + k) * count + s]);
+          bool larger = value > pivot[s - first];
+          pivot[s - first] = larger ? value : pivot[s - first];
+          index[s - first] = larger ? i : index[s - first];
+        }
+      // Перестановка строк; у вырожденных систем диагональ заменяется единицей,
+      // чтобы дальнейшие шаги не порождали NaN в соседних системах
+      for (size_t s = first; s < last; s++)
+      {
+        if (pivot[s - first] < eps)
+        {
+          singular[s] = true;
+          a[(k * n + k) * count + s] = 1;
+          continue;
+        }
+        size_t row = index[s - first];
+        if (row == k)
+          continue;
+        for (size_t j = 0; j < n; j++)
+        {
+          double temp = a[(k * n + j) * count + s];
+          a[(k * n + j) * count + s] = a[(row * n + j) * count + s];
+          a[(row * n + j) * count + s] = temp;
+        }
+        double temp = y[k * count + s];
+        y[k * count + s] = y[row * count + s];
+        y[row * count + s] = temp;
+      }
+      // Исключение k-го неизвестного из нижних уравнений
+      for (size_t i = k + 1; i < n; i++)
+      {
+        for (size_t s = first; s < last; s++)
+          factor[s - first] = a[(i * n + k) * count + s] / a[(k * n + k) * count + s];
+        for (size_t j = k; j < n; j++)
+          for (size_t s = first; s < last; s++)
+            a[(i * n + j) * count + s] -= factor[s - first] * a[(k * n + j) * count + s];
+        for (size_t s = first; s < last; s++)
+          y[i * count + s] -= factor[s - first] * y[k * count + s];
+      }
+    }
+    // обратная подстановка
+    for (size_t k = n; k-- > 0;)
+    {
+      for (size_t s = first; s < last; s++)
+        factor[s - first] = y[k * count + s];
+      for (size_t j = k + 1; j < n; j++)
+        for (size_t s = first; s < last; s++)
+          factor[s - first] -= a[(k * n + j) * count + s] * x[j * count + s];
+      for (size_t s = first; s < last; s++)
+        x[k * count + s] = singular[s] ? 0 : factor[s - first] / a[(k * n + k) * count + s];
+    }
+  }
+}
@@ -0,0 +1,13 @@
+#ifndef GAUSS_BATCH_H
+#define GAUSS_BATCH_H
+
+#include <cstddef>
+
+// Пакетное решение count систем одного размера n методом Гаусса с выбором главного
+// элемента. Системы хранятся вперемешку: элемент a[i][j] системы s лежит в
+// a[(i * n + j) * count + s], y[i] и x[i] -- в y[i * count + s] и x[i * count + s].
+// Для вырожденной системы выставляется singular[s], её решение заполняется нулями.
+// a и y портятся. Реализация в gauss_batch.cpp.
+void gauss_batch(double *a, double *y, double *x, bool *singular, std::size_t n, std::size_t count);
+
+#endif
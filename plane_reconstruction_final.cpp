@@ -4,6 +4,36 @@
 #include <math.h> 
 #include <iomanip> 
 #include <stdexcept>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <cstdint>
+#include <unordered_map>
+#include <random>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "fixed_notation.h"
 
 #define EPS 1e-10
 
@@ -38,7 +68,7 @@ class Matrix {
 
         static Matrix createIdentity(int);
         static Matrix solve(Matrix, Matrix);
-        static Matrix bandSolve(Matrix, Matrix, int);
+        static Matrix bandSolve(const Matrix&, const Matrix&, int);
 
         static double dotProduct(Matrix, Matrix);
 
@@ -52,6 +82,9 @@ class Matrix {
         int rows_, cols_;
         double **p;
 
+        friend class BandMatrix;
+        friend class SparseMatrix;
+
         void allocSpace();
         Matrix expHelper(const Matrix&, int);
 };
@@ -63,6 +96,64 @@ Matrix operator*(const Matrix&, double);
 Matrix operator*(double, const Matrix&);
 Matrix operator/(const Matrix&, double);
 
+// Square matrix that stores only the diagonals from `lower` below to `upper` above the main
+// one, row by row, so memory is O(N*(lower+upper)). factorize() does an in-place LU
+// decomposition without pivoting (which keeps the band) in O(N*lower*upper); the factors can
+// then solve any number of right-hand sides in O(N*(lower+upper)) each.
+class BandMatrix {
+    public:
+        BandMatrix(int, int, int);
+
+        inline double& operator()(int i, int j) { return band_[i * width_ + j - i + lower_]; }
+        double at(int, int) const;
+        bool inBand(int i, int j) const { return j - i <= upper_ && i - j <= lower_; }
+
+        void factorize();
+        Matrix solve(Matrix) const;
+        void solveInPlace(std::vector<double>&) const;
+
+        static BandMatrix fromDense(const Matrix&, int, int);
+
+    private:
+        int n_, lower_, upper_, width_;
+        std::vector<double> band_;
+        bool factored_;
+};
+
+// Compressed sparse row matrix. Entries are collected as (row, column, value) triplets with
+// add(); compress() sorts them into CSR and sums duplicates. Intended for normal equations
+// whose design matrix has a handful of nonzeros per row.
+class SparseMatrix {
+    public:
+        SparseMatrix(int, int);
+
+        void add(int, int, double);
+        void compress();
+
+        int rows() const { return rows_; }
+        int cols() const { return cols_; }
+
+        // y = A x and y = A^T x into a caller-sized y, so iterative solvers allocate nothing per step
+        void multiply(const std::vector<double>&, std::vector<double>&) const;
+        void multiplyTransposed(const std::vector<double>&, std::vector<double>&) const;
+        SparseMatrix transposeTimesSelf() const;
+
+        static std::vector<double> conjugateGradient(const SparseMatrix&, const std::vector<double>&, int, double);
+        static std::vector<double> solveNormalEquations(const SparseMatrix&, const std::vector<double>&, int, double);
+
+    private:
+        struct triplet {
+            int row, col;
+            double value;
+        };
+
+        int rows_, cols_;
+        std::vector<triplet> pending_;
+        std::vector<int> rowStart_;
+        std::vector<int> colIndex_;
+        std::vector<double> values_;
+};
+
 #endif
 
 Matrix::Matrix(int rows, int cols) : rows_(rows), cols_(cols)
@@ -253,35 +344,13 @@ Matrix Matrix::solve(Matrix A, Matrix b)
     return x;
 }
 
-Matrix Matrix::bandSolve(Matrix A, Matrix b, int k)
+// k is the total band width; the (k - 1) / 2 diagonals on each side of the main one are used.
+Matrix Matrix::bandSolve(const Matrix& A, const Matrix& b, int k)
 {
-    int bandsBelow = (k - 1) / 2;
-    for (int i = 0; i < A.rows_; ++i) {
-        if (A.p[i][i] == 0) {
-            throw domain_error("Error: the coefficient matrix has 0 as a pivot. Please fix the input and try again.");
-        }
-        for (int j = i + 1; j < A.rows_ && j <= i + bandsBelow; ++j) {
-            int k = i + 1;
-            while (k < A.cols_ && A.p[j][k]) {
-                A.p[j][k] -= A.p[i][k] * (A.p[j][i] / A.p[i][i]);
-                k++;
-            }
-            b.p[j][0] -= b.p[i][0] * (A.p[j][i] / A.p[i][i]);
-            A.p[j][i] = 0;
-        }
-    }
-
-    Matrix x(b.rows_, 1);
-    x.p[x.rows_ - 1][0] = b.p[x.rows_ - 1][0] / A.p[x.rows_ - 1][x.rows_ - 1];
-    for (int i = x.rows_ - 2; i >= 0; --i) {
-        int sum = 0;
-        for (int j = i + 1; j < x.rows_; ++j) {
-            sum += A.p[i][j] * x.p[j][0];
-        }
-        x.p[i][0] = (b.p[i][0] - sum) / A.p[i][i];
-    }
-
-    return x;
+    int bands = (k - 1) / 2;
+    BandMatrix band = BandMatrix::fromDense(A, bands, bands);
+    band.factorize();
+    return band.solve(b);
 }
 
 double Matrix::dotProduct(Matrix a, Matrix b)
@@ -573,21 +642,411 @@ istream& operator>>(istream& is, Matrix& m)
     }
     return is;
 }
+BandMatrix::BandMatrix(int n, int lower, int upper)
+    : n_(n), lower_(lower), upper_(upper), width_(lower + upper + 1), band_(n * (lower + upper + 1), 0), factored_(false)
+{
+}
+
+double BandMatrix::at(int i, int j) const
+{
+    return inBand(i, j) ? band_[i * width_ + j - i + lower_] : 0;
+}
+
+BandMatrix BandMatrix::fromDense(const Matrix& A, int lower, int upper)
+{
+    BandMatrix band(A.rows_, lower, upper);
+    for (int i = 0; i < A.rows_; ++i) {
+        int first = i - lower > 0 ? i - lower : 0;
+        int last = i + upper < A.cols_ - 1 ? i + upper : A.cols_ - 1;
+        for (int j = first; j <= last; ++j) {
+            band(i, j) = A.p[i][j];
+        }
+    }
+    return band;
+}
+
+void BandMatrix::factorize()
+{
+    for (int k = 0; k < n_; ++k) {
+        double pivot = (*this)(k, k);
+        if (pivot < EPS && pivot > -1*EPS) {
+            throw domain_error("Error: the coefficient matrix has 0 as a pivot. Please fix the input and try again.");
+        }
+        int lastRow = k + lower_ < n_ - 1 ? k + lower_ : n_ - 1;
+        int lastCol = k + upper_ < n_ - 1 ? k + upper_ : n_ - 1;
+        for (int i = k + 1; i <= lastRow; ++i) {
+            double factor = (*this)(i, k) / pivot;
+            (*this)(i, k) = factor;
+            for (int j = k + 1; j <= lastCol; ++j) {
+                (*this)(i, j) -= factor * (*this)(k, j);
+            }
+        }
+    }
+    factored_ = true;
+}
+
+Matrix BandMatrix::solve(Matrix b) const
+{
+    if (!factored_) {
+        throw domain_error("Error: factorize() the band matrix before solving.");
+    }
+    for (int c = 0; c < b.cols_; ++c) {
+        for (int i = 0; i < n_; ++i) {
+            double sum = b(i, c);
+            for (int j = i - lower_ > 0 ? i - lower_ : 0; j < i; ++j) {
+                sum -= band_[i * width_ + j - i + lower_] * b(j, c);
+            }
+            b(i, c) = sum;
+        }
+        for (int i = n_ - 1; i >= 0; --i) {
+            double sum = b(i, c);
+            int last = i + upper_ < n_ - 1 ? i + upper_ : n_ - 1;
+            for (int j = i + 1; j <= last; ++j) {
+                sum -= band_[i * width_ + j - i + lower_] * b(j, c);
+            }
+            b(i, c) = sum / band_[i * width_ + lower_];
+        }
+    }
+    return b;
+}
+
+// Single right-hand side, solved in place in a plain vector.
+void BandMatrix::solveInPlace(std::vector<double>& b) const
+{
+    if (!factored_) {
+        throw domain_error("Error: factorize() the band matrix before solving.");
+    }
+    for (int i = 0; i < n_; ++i) {
+        for (int j = i - lower_ > 0 ? i - lower_ : 0; j < i; ++j) {
+            b[i] -= band_[i * width_ + j - i + lower_] * b[j];
+        }
+    }
+    for (int i = n_ - 1; i >= 0; --i) {
+        int last = i + upper_ < n_ - 1 ? i + upper_ : n_ - 1;
+        for (int j = i + 1; j <= last; ++j) {
+            b[i] -= band_[i * width_ + j - i + lower_] * b[j];
+        }
+        b[i] /= band_[i * width_ + lower_];
+    }
+}
+
+SparseMatrix::SparseMatrix(int rows, int cols) : rows_(rows), cols_(cols), rowStart_(rows + 1, 0)
+{
+}
+
+void SparseMatrix::add(int i, int j, double value)
+{
+    triplet entry = {i, j, value};
+    pending_.push_back(entry);
+}
+
+void SparseMatrix::compress()
+{
+    for (int i = 0; i < rows_; ++i) {
+        for (int k = rowStart_[i]; k < rowStart_[i + 1]; ++k) {
+            triplet entry = {i, colIndex_[k], values_[k]};
+            pending_.push_back(entry);
+        }
+    }
+    std::sort(pending_.begin(), pending_.end(), [](const triplet& l, const triplet& r) {
+        return l.row < r.row || (l.row == r.row && l.col < r.col);
+    });
+    rowStart_.assign(rows_ + 1, 0);
+    colIndex_.clear();
+    values_.clear();
+    for (size_t k = 0; k < pending_.size(); ++k) {
+        if (!colIndex_.empty() && k > 0 && pending_[k].row == pending_[k - 1].row && pending_[k].col == pending_[k - 1].col) {
+            values_.back() += pending_[k].value;
+            continue;
+        }
+        colIndex_.push_back(pending_[k].col);
+        values_.push_back(pending_[k].value);
+        rowStart_[pending_[k].row + 1]++;
+    }
+    for (int i = 0; i < rows_; ++i) {
+        rowStart_[i + 1] += rowStart_[i];
+    }
+    pending_.clear();
+}
+
+void SparseMatrix::multiply(const std::vector<double>& x, std::vector<double>& y) const
+{
+    for (int i = 0; i < rows_; ++i) {
+        double sum = 0;
+        for (int k = rowStart_[i]; k < rowStart_[i + 1]; ++k) {
+            sum += values_[k] * x[colIndex_[k]];
+        }
+        y[i] = sum;
+    }
+}
+
+void SparseMatrix::multiplyTransposed(const std::vector<double>& x, std::vector<double>& y) const
+{
+    std::fill(y.begin(), y.begin() + cols_, 0.0);
+    for (int i = 0; i < rows_; ++i) {
+        for (int k = rowStart_[i]; k < rowStart_[i + 1]; ++k) {
+            y[colIndex_[k]] += values_[k] * x[i];
+        }
+    }
+}
+
+SparseMatrix SparseMatrix::transposeTimesSelf() const
+{
+    SparseMatrix normal(cols_, cols_);
+    for (int i = 0; i < rows_; ++i) {
+        for (int k = rowStart_[i]; k < rowStart_[i + 1]; ++k) {
+            for (int l = rowStart_[i]; l < rowStart_[i + 1]; ++l) {
+                normal.add(colIndex_[k], colIndex_[l], values_[k] * values_[l]);
+            }
+        }
+    }
+    normal.compress();
+    return normal;
+}
+
+static double dot(const std::vector<double>& a, const std::vector<double>& b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// Conjugate gradients for a symmetric positive definite A; stops when |r| <= tolerance*|b|.
+// The five work vectors are allocated once, before the first iteration.
+std::vector<double> SparseMatrix::conjugateGradient(const SparseMatrix& A, const std::vector<double>& b, int maxIterations,
+                                                    double tolerance)
+{
+    std::vector<double> x(A.cols_, 0.0), r(b), d(b), Ad(A.rows_);
+    double rr = dot(r, r);
+    double limit = tolerance * tolerance * rr;
+    for (int iteration = 0; iteration < maxIterations && rr > limit; ++iteration) {
+        A.multiply(d, Ad);
+        double alpha = rr / dot(d, Ad);
+        for (int i = 0; i < A.cols_; ++i) {
+            x[i] += alpha * d[i];
+            r[i] -= alpha * Ad[i];
+        }
+        double next = dot(r, r);
+        for (int i = 0; i < A.cols_; ++i) {
+            d[i] = r[i] + (next / rr) * d[i];
+        }
+        rr = next;
+    }
+    return x;
+}
+
+// Least squares min |A x - b| through CG on A^T A x = A^T b, without forming A^T A.
+std::vector<double> SparseMatrix::solveNormalEquations(const SparseMatrix& A, const std::vector<double>& b, int maxIterations,
+                                                       double tolerance)
+{
+    std::vector<double> rhs(A.cols_), Ad(A.cols_), Ax(A.rows_);
+    A.multiplyTransposed(b, rhs);
+    std::vector<double> x(A.cols_, 0.0), r(rhs), d(rhs);
+    double rr = dot(r, r);
+    double limit = tolerance * tolerance * rr;
+    for (int iteration = 0; iteration < maxIterations && rr > limit; ++iteration) {
+        A.multiply(d, Ax);
+        A.multiplyTransposed(Ax, Ad);
+        double alpha = rr / dot(d, Ad);
+        for (int i = 0; i < A.cols_; ++i) {
+            x[i] += alpha * d[i];
+            r[i] -= alpha * Ad[i];
+        }
+        double next = dot(r, r);
+        for (int i = 0; i < A.cols_; ++i) {
+            d[i] = r[i] + (next / rr) * d[i];
+        }
+        rr = next;
+    }
+    return x;
+}
+
 using namespace std;
 
+#ifdef COUNT_ALLOCATIONS
+// Build with -DCOUNT_ALLOCATIONS to let --benchmark report heap allocations made during a fit.
+// Every replaceable form is replaced, so whatever form the library picks pairs with these.
+static long allocation_count = 0;
+
+void* counted_allocate(size_t size) noexcept
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return malloc(size ? size : 1);
+}
+
+// kept out of line, so the compiler does not pair malloc/free across the operators itself
+__attribute__((noinline)) void counted_release(void *ptr) noexcept { free(ptr); }
+
+void* operator new(size_t size)
+{
+    void *ptr = counted_allocate(size);
+    if (!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    void *ptr = counted_allocate(size);
+    if (!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept { return counted_allocate(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return counted_allocate(size); }
+
+void operator delete(void *ptr) noexcept { counted_release(ptr); }
+void operator delete[](void *ptr) noexcept { counted_release(ptr); }
+void operator delete(void *ptr, size_t) noexcept { counted_release(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { counted_release(ptr); }
+void operator delete(void *ptr, const nothrow_t&) noexcept { counted_release(ptr); }
+void operator delete[](void *ptr, const nothrow_t&) noexcept { counted_release(ptr); }
+
+long allocations_so_far() { return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED); }
+#else
+long allocations_so_far() { return -1; }
+#endif
+
+// Bump allocator for fit-time temporaries. Memory is only given back by reset(); if a fit
+// outgrew the first block, reset() replaces the chain with one block of the combined size,
+// so from the second fit on the hot path does not touch the heap. Not thread-safe: every
+// thread owns its own fit_context.
+class scratch_arena {
+    public:
+        explicit scratch_arena(size_t capacity = 1 << 20);
+        ~scratch_arena();
+        scratch_arena(const scratch_arena&) = delete;
+        scratch_arena& operator=(const scratch_arena&) = delete;
+
+        void* allocate(size_t bytes, size_t alignment);
+        template <typename T> T* allocate_array(size_t count)
+        {
+            return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        }
+        void reset();
+
+        size_t capacity() const { return total_capacity_; }
+
+    private:
+        struct block {
+            block *previous;
+            size_t size;
+        };
+
+        block *current_;
+        size_t used_;
+        size_t total_capacity_;
+
+        void addBlock(size_t);
+        void releaseBlocks();
+};
+
+scratch_arena::scratch_arena(size_t capacity) : current_(0), used_(0), total_capacity_(0)
+{
+    addBlock(capacity);
+}
+
+scratch_arena::~scratch_arena()
+{
+    releaseBlocks();
+}
+
+void* scratch_arena::allocate(size_t bytes, size_t alignment)
+{
+    size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+    if (offset + bytes > current_->size) {
+        addBlock(max(current_->size * 2, bytes + alignment));
+        offset = (used_ + alignment - 1) & ~(alignment - 1);
+    }
+    used_ = offset + bytes;
+    return reinterpret_cast<char*>(current_ + 1) + offset;
+}
+
+void scratch_arena::reset()
+{
+    if (current_->previous) {
+        size_t capacity = total_capacity_;
+        releaseBlocks();
+        addBlock(capacity);
+    }
+    used_ = 0;
+}
+
+void scratch_arena::addBlock(size_t size)
+{
+    // the two-word header keeps the payload aligned like any operator new result
+    block *next = static_cast<block*>(::operator new(sizeof(block) + size));
+    next->previous = current_;
+    next->size = size;
+    current_ = next;
+    used_ = 0;
+    total_capacity_ += size;
+}
+
+void scratch_arena::releaseBlocks()
+{
+    while (current_) {
+        block *previous = current_->previous;
+        ::operator delete(current_);
+        current_ = previous;
+    }
+    total_capacity_ = 0;
+}
+
+// Lets standard containers draw from a scratch_arena; deallocation is deferred to reset().
+template <typename T>
+struct arena_allocator
+{
+    typedef T value_type;
+    scratch_arena *arena;
+
+    arena_allocator(scratch_arena &a) : arena(&a) {}
+    template <typename U> arena_allocator(const arena_allocator<U> &other) : arena(other.arena) {}
+
+    T* allocate(size_t count) { return arena->allocate_array<T>(count); }
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T> &lhs, const arena_allocator<U> &rhs) { return lhs.arena == rhs.arena; }
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T> &lhs, const arena_allocator<U> &rhs) { return lhs.arena != rhs.arena; }
+
 struct point3d
 {
     double x;
     double y;
     double z;
-    double distance;
+};
+
+struct plane_hypothesis
+{
+    double a;
+    double b;
+    double c;
+    double d;
+    long inliers;
+    bool degenerate;
+};
+
+// Per-thread solver state; everything allocated while fitting comes from `arena`.
+struct fit_context
+{
+    scratch_arena arena;
+    // every plane found by the last multi-plane search (Hough peaks, regions), strongest first
+    vector<plane_hypothesis> detected;
+    // per-point region of the last region-growing search (index into detected, or -1); empty otherwise
+    vector<int> labels;
 };
 
 bool belonging_of_point_to_plane(double a, double b, double c, double d, double x, double y, double z, double p){
     return fabs(a*x+b*y+c*z+d) <= p;
 }
 
-vector<double> plane_equation_coefficients_by_3points(double x1,double y1,double z1,double x2,double y2,double z2,double x3,double y3,double z3){
+plane_hypothesis plane_equation_coefficients_by_3points(double x1,double y1,double z1,double x2,double y2,double z2,double x3,double y3,double z3){
     double a1 = x2 - x1;
     double b1 = y2 - y1;
     double c1 = z2 - z1;
@@ -598,125 +1057,2251 @@ vector<double> plane_equation_coefficients_by_3points(double x1,double y1,double
     double b = a2 * c1 - a1 * c2;
     double c = a1 * b2 - b1 * a2;
     double d = (-a * x1 - b * y1 - c * z1);
-    vector<double> coefficients{a, b, c, d};
+    plane_hypothesis coefficients = {a, b, c, d, 0, fabs(a) + fabs(b) + fabs(c) == 0};
     return coefficients;
 }
 
-void quick_sort_vector_by_distance(vector<point3d> &points_cloud, vector<point3d>::size_type left, vector<point3d>::size_type right)
-{ 
-  int left_edge = left; 
-  int right_edge = right;
-  double pvt;
-
-  pvt = points_cloud[left].distance;
-  while (left < right){
-    while ((points_cloud[right].distance >= pvt) && (left < right))
-      right--; 
-    if (left != right){
-        points_cloud[left] = points_cloud[right]; 
-        left++; 
-    }
-    while ((points_cloud[left].distance <= pvt) && (left < right))
-        left++; 
-    if (left != right){
-        points_cloud[right] = points_cloud[left]; 
-        right--; 
-    }
-  }
-
-  points_cloud[left].distance = pvt; 
-  pvt = left;
-  left = left_edge;
-  right = right_edge;
-  if (left < pvt) 
-    quick_sort_vector_by_distance(points_cloud, left, pvt - 1);
-  if (right > pvt)
-    quick_sort_vector_by_distance(points_cloud, pvt + 1, right);
-}
-
-double length_of_perpendicular_to_plane(double a, double b, double c, double d, double x1, double y1, double z1) 
-{ 
-    double k = (-a * x1 - b * y1 - c * z1 - d) / (double)(a * a + b * b + c * c); 
-    double x2 = a * k + x1; 
-    double y2 = b * k + y1; 
-    double z2 = c * k + z1; 
-
-    double ax = x2 - x1;
-    double ay = y2 - y1;
-    double az = z2 - z1;
-    double vector_length = sqrt(pow(ax,2) + pow(ay,2) + pow(az,2));
-  
-    return vector_length;
-} 
+enum residual_kind { RESIDUAL_SIGNED, RESIDUAL_ABSOLUTE, RESIDUAL_SQUARED };
+
+// The plane scaled to a unit normal, so a*x+b*y+c*z+d is the signed distance to it.
+plane_hypothesis normalize_plane(const plane_hypothesis &plane){
+    double length = sqrt(plane.a * plane.a + plane.b * plane.b + plane.c * plane.c);
+    plane_hypothesis normalized = plane;
+    if(length > 0) {
+        normalized.a /= length;
+        normalized.b /= length;
+        normalized.c /= length;
+        normalized.d /= length;
+    }
+    return normalized;
+}
+
+template <residual_kind kind>
+void fill_plane_residuals(const point3d *points, vector<point3d>::size_type n, const plane_hypothesis &unit, double *residuals){
+    const double a = unit.a, b = unit.b, c = unit.c, d = unit.d;
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        double r = a * points[i].x + b * points[i].y + c * points[i].z + d;
+        if(kind == RESIDUAL_ABSOLUTE)
+            r = fabs(r);
+        else if(kind == RESIDUAL_SQUARED)
+            r = r * r;
+        residuals[i] = r;
+    }
+}
+
+// Point-to-plane distances for the whole cloud in one pass; the normal is normalized once up front.
+void plane_residuals(const vector<point3d> &points_cloud, const plane_hypothesis &plane, residual_kind kind, double *residuals){
+    plane_hypothesis unit = normalize_plane(plane);
+    switch(kind) {
+        case RESIDUAL_SIGNED:
+            fill_plane_residuals<RESIDUAL_SIGNED>(points_cloud.data(), points_cloud.size(), unit, residuals);
+            break;
+        case RESIDUAL_ABSOLUTE:
+            fill_plane_residuals<RESIDUAL_ABSOLUTE>(points_cloud.data(), points_cloud.size(), unit, residuals);
+            break;
+        case RESIDUAL_SQUARED:
+            fill_plane_residuals<RESIDUAL_SQUARED>(points_cloud.data(), points_cloud.size(), unit, residuals);
+            break;
+    }
+}
+
+// Binary clouds from point_cloud_generator: "PLCD", uint32 version 1, double p, uint64 count,
+// then count x,y,z doubles. Anything else is read as the usual text format.
+bool read_binary_cloud(ifstream &read, double &p, int &number_of_points, vector<point3d> &points_cloud){
+    char magic[4];
+    uint32_t version = 0;
+    uint64_t count = 0;
+    if(!read.read(magic, sizeof(magic)) || memcmp(magic, "PLCD", sizeof(magic)) != 0) {
+        read.clear();
+        read.seekg(0);
+        return false;
+    }
+    read.read(reinterpret_cast<char*>(&version), sizeof(version));
+    read.read(reinterpret_cast<char*>(&p), sizeof(p));
+    read.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if(!read || version != 1)
+        throw runtime_error("Error: unsupported binary point cloud header");
+    number_of_points = count;
+    vector<double> coordinates(3 * count);
+    if(!read.read(reinterpret_cast<char*>(coordinates.data()), coordinates.size() * sizeof(double)))
+        throw runtime_error("Error: binary point cloud is shorter than its header says");
+    points_cloud.resize(count);
+    for(uint64_t i = 0; i < count; i++) {
+        points_cloud[i].x = coordinates[3 * i];
+        points_cloud[i].y = coordinates[3 * i + 1];
+        points_cloud[i].z = coordinates[3 * i + 2];
+    }
+    return true;
+}
+
+bool is_binary_cloud(const string &path_to_file){
+    char magic[4] = {0, 0, 0, 0};
+    ifstream read(path_to_file, ios::binary);
+    read.read(magic, sizeof(magic));
+    return memcmp(magic, "PLCD", sizeof(magic)) == 0;
+}
 
 void read_file(string path_to_file, double &p, int &number_of_points, vector<point3d> &points_cloud){
     point3d point;
-    ifstream read(path_to_file);
-    if(!read.eof()){
-        read >> p;
-        read >> number_of_points;
-        while(!read.eof()){
-            read >> point.x;
-            read >> point.y;
-            read >> point.z;
-            points_cloud.push_back(point);
+    ifstream read(path_to_file, ios::binary);
+    if(!read)
+        throw runtime_error("Error: cannot open " + path_to_file + ".");
+    if(read_binary_cloud(read, p, number_of_points, points_cloud))
+        return;
+    if(!(read >> p >> number_of_points))
+        throw runtime_error("Error: cannot read the header of " + path_to_file + ".");
+    // a point is kept only once all three coordinates parsed
+    while(read >> point.x >> point.y >> point.z)
+        points_cloud.push_back(point);
+}
+
+// Hypothesis i is the plane through points i, i+1, i+2.
+plane_hypothesis make_hypothesis(const vector<point3d> &points_cloud, vector<point3d>::size_type i){
+    return plane_equation_coefficients_by_3points(points_cloud[i].x,points_cloud[i].y,points_cloud[i].z,
+                                                  points_cloud[i+1].x,points_cloud[i+1].y,points_cloud[i+1].z,
+                                                  points_cloud[i+2].x,points_cloud[i+2].y,points_cloud[i+2].z);
+}
+
+// Counts every third point from `first` whose triplet lies below `end`, i.e. the same points
+// the full scan visits with `i <= points_cloud.size()-3` once `end` reaches the cloud size.
+long count_points_near_plane(const vector<point3d> &points_cloud, const plane_hypothesis &hypothesis,
+                             vector<point3d>::size_type first, vector<point3d>::size_type end, double p){
+    long inliers = 0;
+    for(vector<point3d>::size_type i = first; i + 2 < end; i+=3) {
+        if(fabs(points_cloud[i].x*hypothesis.a+points_cloud[i].y*hypothesis.b+points_cloud[i].z*hypothesis.c+hypothesis.d)<=p){
+            inliers++;
         }
     }
+    return inliers;
 }
 
-int main(){
-    int number_of_points;
-    double a, b, c, d, x, y, z, p;
-    vector<point3d> points_cloud;
-    string path_to_file = "input.txt";
-    ofstream write("output.txt");
-    read_file(path_to_file, p, number_of_points, points_cloud);
-    double perpendicular_length = 0;
-    vector<double> current_coefficients{0,0,0,0};
-    vector<double> most_fitted_coefficients{0,0,0,0};
-    double current_fitment_score = 0;
-    double most_fitment_score = 0;
-   
-        for(vector<point3d>::size_type i = 0; i <= points_cloud.size()-3; i++) {
-        current_coefficients = plane_equation_coefficients_by_3points(   points_cloud[i].x,points_cloud[i].y,points_cloud[i].z,
-                                                                    points_cloud[i+1].x,points_cloud[i+1].y,points_cloud[i+1].z,
-                                                                    points_cloud[i+2].x,points_cloud[i+2].y,points_cloud[i+2].z);
-            if(fabs(current_coefficients[0]) + fabs(current_coefficients[1]) + fabs(current_coefficients[2]) != 0 ){
-                current_fitment_score = 0;
-                for(vector<point3d>::size_type i = 0; i <= points_cloud.size()-3; i+=3) {
-                    if(fabs(points_cloud[i].x*current_coefficients[0]+points_cloud[i].y*current_coefficients[1]+points_cloud[i].z*current_coefficients[2]+current_coefficients[3])<=p){
-                        current_fitment_score++;
-                    }
-                }
-                current_fitment_score/=number_of_points;
-                if(current_fitment_score > most_fitment_score) {
-                    most_fitted_coefficients = current_coefficients;
-                    most_fitment_score = current_fitment_score;
-                }
-            }
+// True distance test of the refinements' search: `unit` has a unit normal. The operations are
+// grouped like the vector loops of score_plane_with_mask, so both give the same answer.
+inline bool near_unit_plane(const plane_hypothesis &unit, const point3d &q, double p){
+    return fabs((unit.a * q.x + unit.b * q.y) + (unit.c * q.z + unit.d)) <= p;
+}
+
+// Counts every point in [first, end) within true distance p of the plane.
+long count_points_within(const vector<point3d> &points_cloud, const plane_hypothesis &hypothesis,
+                         vector<point3d>::size_type first, vector<point3d>::size_type end, double p){
+    plane_hypothesis unit = normalize_plane(hypothesis);
+    long inliers = 0;
+    for(vector<point3d>::size_type i = first; i < end; i++)
+        inliers += near_unit_plane(unit, points_cloud[i], p);
+    return inliers;
+}
+
+typedef vector<plane_hypothesis, arena_allocator<plane_hypothesis>> hypothesis_list;
+
+// First hypothesis with the strictly highest inlier count, or an all-zero plane if none has inliers.
+
+plane_hypothesis select_most_fitted(const hypothesis_list &hypotheses){
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    for(hypothesis_list::size_type i = 0; i < hypotheses.size(); i++) {
+        if(!hypotheses[i].degenerate && hypotheses[i].inliers > most_fitted.inliers) {
+            most_fitted = hypotheses[i];
         }
-        for(vector<point3d>::size_type i = 0; i < points_cloud.size(); i++) {
-            points_cloud[i].distance = length_of_perpendicular_to_plane(most_fitted_coefficients[0], most_fitted_coefficients[1],
-                                                                        most_fitted_coefficients[2],most_fitted_coefficients[3],
-                                                                        points_cloud[i].x,points_cloud[i].y,points_cloud[i].z);
+    }
+    return most_fitted;
+}
+
+plane_hypothesis find_most_fitted_plane(const vector<point3d> &points_cloud, double p){
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    for(vector<point3d>::size_type i = 0; i + 2 < points_cloud.size(); i++) {
+        plane_hypothesis current = make_hypothesis(points_cloud, i);
+        if(!current.degenerate){
+            current.inliers = count_points_near_plane(points_cloud, current, 0, points_cloud.size(), p);
+            if(current.inliers > most_fitted.inliers) {
+                most_fitted = current;
+            }
         }
-        quick_sort_vector_by_distance(points_cloud, 0, points_cloud.size()-1);
+    }
+    return most_fitted;
+}
+
+const vector<point3d>::size_type READ_CHUNK_SIZE = 4096;
+
+struct point_chunk_queue
+{
+    mutex guard;
+    condition_variable ready;
+    deque<vector<point3d>> chunks;
+    bool finished = false;
+};
 
-        Matrix A(points_cloud.size()/2, 3), B(points_cloud.size()/2, 1), fitness(3, 1);
+// Reader stage of the pipelined mode: parses points exactly like read_file, but hands them over in chunks.
+void read_points_async(ifstream &read, point_chunk_queue &queue){
+    point3d point;
+    vector<point3d> chunk;
+    chunk.reserve(READ_CHUNK_SIZE);
+    while(read >> point.x >> point.y >> point.z){
+        chunk.push_back(point);
+        if(chunk.size() == READ_CHUNK_SIZE){
+            {
+                lock_guard<mutex> lock(queue.guard);
+                queue.chunks.push_back(move(chunk));
+            }
+            queue.ready.notify_one();
+            chunk = vector<point3d>();
+            chunk.reserve(READ_CHUNK_SIZE);
+        }
+    }
+    {
+        lock_guard<mutex> lock(queue.guard);
+        if(!chunk.empty())
+            queue.chunks.push_back(move(chunk));
+        queue.finished = true;
+    }
+    queue.ready.notify_one();
+}
 
-        for(vector<point3d>::size_type i = 0; i < points_cloud.size()/2; i++) {
-            A(i, 0) = points_cloud[i].x;
-            A(i, 1) = points_cloud[i].y;
-            A(i, 2) = 1;
-            B(i, 0) = points_cloud[i].z;
+// Searches the loaded prefix while the reader stage is still parsing. Every hypothesis keeps
+// its own inlier count, which is extended over newly arrived points, so once the file is
+// exhausted the counts (and the selected plane) are identical to find_most_fitted_plane, or
+// with `true_distance` to find_most_fitted_plane_with_mask.
+plane_hypothesis find_most_fitted_plane_pipelined(ifstream &read, double p, int number_of_points, bool true_distance,
+                                                  vector<point3d> &points_cloud, fit_context &context, ostream &progress){
+    point_chunk_queue queue;
+    thread reader(read_points_async, ref(read), ref(queue));
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    hypothesis_list hypotheses{arena_allocator<plane_hypothesis>(context.arena)};
+    vector<point3d>::size_type scored_end = 0;
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    bool finished = false;
+    if(number_of_points > 0) {
+        points_cloud.reserve(number_of_points);
+        hypotheses.reserve(number_of_points);
+    }
+    while(!finished){
+        deque<vector<point3d>> arrived;
+        {
+            unique_lock<mutex> lock(queue.guard);
+            queue.ready.wait(lock, [&queue]{ return !queue.chunks.empty() || queue.finished; });
+            arrived.swap(queue.chunks);
+            finished = queue.finished;
+        }
+        vector<point3d>::size_type loaded = points_cloud.size();
+        for(deque<vector<point3d>>::size_type i = 0; i < arrived.size(); i++)
+            points_cloud.insert(points_cloud.end(), arrived[i].begin(), arrived[i].end());
+        if(points_cloud.size() < 3)
+            continue;
+
+        // Scored points are every third index (every index with true distances); resume from
+        // the first one not yet counted.
+        vector<point3d>::size_type first_new = true_distance ? loaded : scored_end;
+        for(hypothesis_list::size_type i = 0; i < hypotheses.size(); i++) {
+            if(hypotheses[i].degenerate)
+                continue;
+            if(true_distance)
+                hypotheses[i].inliers += count_points_within(points_cloud, hypotheses[i], first_new, points_cloud.size(), p);
+            else
+                hypotheses[i].inliers += count_points_near_plane(points_cloud, hypotheses[i], first_new, points_cloud.size(), p);
         }
-        fitness = (A.transpose() * A).inverse() * A.transpose() * B;
-        a = fitness(0, 0) * -1;
-        b = fitness(1, 0) * -1;
-        c = 1;
-        d = fitness(2, 0) * -1;
-    write.precision(6);
-    write<<fixed<<a<<" "<<b<<" "<<c<<" "<<d;
+        for(vector<point3d>::size_type i = hypotheses.size(); i + 2 < points_cloud.size(); i++) {
+            plane_hypothesis current = make_hypothesis(points_cloud, i);
+            if(!current.degenerate && true_distance)
+                current.inliers = count_points_within(points_cloud, current, 0, points_cloud.size(), p);
+            else if(!current.degenerate)
+                current.inliers = count_points_near_plane(points_cloud, current, 0, points_cloud.size(), p);
+            hypotheses.push_back(current);
+        }
+        while(scored_end + 2 < points_cloud.size())
+            scored_end += 3;
+
+        most_fitted = select_most_fitted(hypotheses);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        progress << "Loaded " << points_cloud.size() << " points, " << elapsed << " s: most fitted "
+                 << most_fitted.a << " " << most_fitted.b << " " << most_fitted.c << " " << most_fitted.d
+                 << " (" << most_fitted.inliers << " inliers)" << endl;
+    }
+    reader.join();
+    return most_fitted;
+}
+
+// One bit per point of the cloud, set when the point lies within p of the plane.
+struct inlier_mask
+{
+    uint64_t *words;
+    vector<point3d>::size_type points;
+};
+
+vector<point3d>::size_type mask_words(vector<point3d>::size_type points){
+    return (points + 63) / 64;
+}
+
+void clear_inlier_mask(inlier_mask &mask){
+    for(vector<point3d>::size_type w = 0; w < mask_words(mask.points); w++)
+        mask.words[w] = 0;
+}
+
+inlier_mask allocate_inlier_mask(vector<point3d>::size_type points, scratch_arena &arena){
+    inlier_mask mask = {arena.allocate_array<uint64_t>(mask_words(points)), points};
+    clear_inlier_mask(mask);
+    return mask;
+}
+
+long mask_count(const inlier_mask &mask){
+    long count = 0;
+    for(vector<point3d>::size_type w = 0; w < mask_words(mask.points); w++)
+        count += __builtin_popcountll(mask.words[w]);
+    return count;
+}
+
+long mask_overlap(const inlier_mask &first, const inlier_mask &second){
+    long count = 0;
+    for(vector<point3d>::size_type w = 0; w < mask_words(first.points); w++)
+        count += __builtin_popcountll(first.words[w] & second.words[w]);
+    return count;
+}
+
+void mask_union(const inlier_mask &first, const inlier_mask &second, inlier_mask &result){
+    for(vector<point3d>::size_type w = 0; w < mask_words(first.points); w++)
+        result.words[w] = first.words[w] | second.words[w];
+}
+
+// Scores a plane against every point of the cloud, recording the consensus set in `mask`.
+// Distances are true ones (the plane is normalized first, as in plane_residuals). They are
+// compared a vector register at a time and the results packed with movemask.
+long score_plane_with_mask(const vector<point3d> &points_cloud, const plane_hypothesis &hypothesis, double p, inlier_mask &mask){
+    vector<point3d>::size_type n = points_cloud.size();
+    vector<point3d>::size_type i = 0;
+    plane_hypothesis plane = normalize_plane(hypothesis);
+#if defined(__AVX__)
+    __m256d a = _mm256_set1_pd(plane.a), b = _mm256_set1_pd(plane.b), c = _mm256_set1_pd(plane.c), d = _mm256_set1_pd(plane.d);
+    __m256d threshold = _mm256_set1_pd(p), sign = _mm256_set1_pd(-0.0);
+    for(; i + 4 <= n; i += 4) {
+        const point3d *q = &points_cloud[i];
+        __m256d x = _mm256_set_pd(q[3].x, q[2].x, q[1].x, q[0].x);
+        __m256d y = _mm256_set_pd(q[3].y, q[2].y, q[1].y, q[0].y);
+        __m256d z = _mm256_set_pd(q[3].z, q[2].z, q[1].z, q[0].z);
+        __m256d r = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, x), _mm256_mul_pd(b, y)), _mm256_add_pd(_mm256_mul_pd(c, z), d));
+        uint64_t bits = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(sign, r), threshold, _CMP_LE_OQ));
+        mask.words[i / 64] |= bits << (i % 64);
+    }
+#elif defined(__SSE2__)
+    __m128d a = _mm_set1_pd(plane.a), b = _mm_set1_pd(plane.b), c = _mm_set1_pd(plane.c), d = _mm_set1_pd(plane.d);
+    __m128d threshold = _mm_set1_pd(p), sign = _mm_set1_pd(-0.0);
+    for(; i + 2 <= n; i += 2) {
+        const point3d *q = &points_cloud[i];
+        __m128d x = _mm_set_pd(q[1].x, q[0].x);
+        __m128d y = _mm_set_pd(q[1].y, q[0].y);
+        __m128d z = _mm_set_pd(q[1].z, q[0].z);
+        __m128d r = _mm_add_pd(_mm_add_pd(_mm_mul_pd(a, x), _mm_mul_pd(b, y)), _mm_add_pd(_mm_mul_pd(c, z), d));
+        uint64_t bits = _mm_movemask_pd(_mm_cmple_pd(_mm_andnot_pd(sign, r), threshold));
+        mask.words[i / 64] |= bits << (i % 64);
+    }
+#endif
+    for(; i < n; i++) {
+        if(near_unit_plane(plane, points_cloud[i], p))
+            mask.words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+    return mask_count(mask);
+}
+
+// The triplet scan of find_most_fitted_plane, scored by true distance over every point. The
+// winner's consensus set is left in `best`, so the refinement reads it instead of rescoring.
+plane_hypothesis find_most_fitted_plane_with_mask(const vector<point3d> &points_cloud, double p, inlier_mask &best,
+                                                  scratch_arena &arena){
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    inlier_mask current = allocate_inlier_mask(points_cloud.size(), arena);
+    clear_inlier_mask(best);
+    for(vector<point3d>::size_type i = 0; i + 2 < points_cloud.size(); i++) {
+        plane_hypothesis hypothesis = make_hypothesis(points_cloud, i);
+        if(hypothesis.degenerate)
+            continue;
+        clear_inlier_mask(current);
+        hypothesis.inliers = score_plane_with_mask(points_cloud, hypothesis, p, current);
+        if(hypothesis.inliers > most_fitted.inliers) {
+            most_fitted = hypothesis;
+            swap(best.words, current.words);
+        }
+    }
+    return most_fitted;
+}
+
+// Solves the 3x3 system m * x = rhs in place with partial pivoting; false if it is singular.
+bool solve_3x3(double m[3][3], double rhs[3], double x[3]){
+    for(int k = 0; k < 3; k++) {
+        int pivot = k;
+        for(int i = k + 1; i < 3; i++) {
+            if(fabs(m[i][k]) > fabs(m[pivot][k]))
+                pivot = i;
+        }
+        if(fabs(m[pivot][k]) < EPS)
+            return false;
+        if(pivot != k) {
+            swap(m[pivot], m[k]);
+            swap(rhs[pivot], rhs[k]);
+        }
+        for(int i = k + 1; i < 3; i++) {
+            double factor = m[i][k] / m[k][k];
+            for(int j = k; j < 3; j++)
+                m[i][j] -= factor * m[k][j];
+            rhs[i] -= factor * rhs[k];
+        }
+    }
+    for(int k = 2; k >= 0; k--) {
+        double sum = rhs[k];
+        for(int j = k + 1; j < 3; j++)
+            sum -= m[k][j] * x[j];
+        x[k] = sum / m[k][k];
+    }
+    return true;
+}
+
+// Sums of the normal equations for z = f0*x + f1*y + f2; zz completes the covariance for
+// orthogonal fits.
+struct plane_moments
+{
+    double xx, xy, x, yy, y, xz, yz, z, n, zz;
+};
+
+void add_point_to_moments(plane_moments &moments, const point3d &point, double weight = 1){
+    double wx = weight * point.x;
+    double wy = weight * point.y;
+    moments.xx += wx * point.x;
+    moments.xy += wx * point.y;
+    moments.x += wx;
+    moments.yy += wy * point.y;
+    moments.y += wy;
+    moments.xz += wx * point.z;
+    moments.yz += wy * point.z;
+    moments.z += weight * point.z;
+    moments.n += weight;
+    moments.zz += weight * point.z * point.z;
+}
+
+void merge_moments(plane_moments &moments, const plane_moments &other){
+    moments.xx += other.xx;
+    moments.xy += other.xy;
+    moments.x += other.x;
+    moments.yy += other.yy;
+    moments.y += other.y;
+    moments.xz += other.xz;
+    moments.yz += other.yz;
+    moments.z += other.z;
+    moments.n += other.n;
+    moments.zz += other.zz;
+}
+
+// Least-squares plane for the accumulated moments, written as a*x+b*y+z+d = 0.
+plane_hypothesis plane_from_moments(const plane_moments &moments, long inliers){
+    double normal[3][3] = {{moments.xx, moments.xy, moments.x},
+                           {moments.xy, moments.yy, moments.y},
+                           {moments.x,  moments.y,  moments.n}};
+    double rhs[3] = {moments.xz, moments.yz, moments.z};
+    double fitness[3] = {0, 0, 0};
+    if(!solve_3x3(normal, rhs, fitness))
+        throw domain_error("Error: the selected points do not determine a plane z = f(x, y).");
+    plane_hypothesis refined = {fitness[0] * -1, fitness[1] * -1, 1, fitness[2] * -1, inliers, false};
+    return refined;
+}
+
+// Unit eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix; returns that eigenvalue.
+// Eigenvalues come from the closed-form trigonometric solution, the vector from the largest
+// cross product of two rows of (m - lambda*I).
+double smallest_eigenvector(const double m[3][3], double vector3[3]){
+    double p1 = m[0][1] * m[0][1] + m[0][2] * m[0][2] + m[1][2] * m[1][2];
+    double q = (m[0][0] + m[1][1] + m[2][2]) / 3;
+    double p2 = pow(m[0][0] - q, 2) + pow(m[1][1] - q, 2) + pow(m[2][2] - q, 2) + 2 * p1;
+    double scale = sqrt(p2 / 6);
+    if(scale < 1e-300) {
+        vector3[0] = 0;
+        vector3[1] = 0;
+        vector3[2] = 1;
+        return q;
+    }
+    double b[3][3];
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 3; j++)
+            b[i][j] = (m[i][j] - (i == j ? q : 0)) / scale;
+    }
+    double r = (b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1]) - b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0])
+                + b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0])) / 2;
+    double phi = r <= -1 ? M_PI / 3 : (r >= 1 ? 0 : acos(r) / 3);
+    double lambda = q + 2 * scale * cos(phi + 2 * M_PI / 3);
+
+    double rows[3][3];
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 3; j++)
+            rows[i][j] = m[i][j] - (i == j ? lambda : 0);
+    }
+    double best = -1;
+    for(int i = 0; i < 3; i++) {
+        const double *u = rows[i], *v = rows[(i + 1) % 3];
+        double c[3] = {u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0]};
+        double length = c[0] * c[0] + c[1] * c[1] + c[2] * c[2];
+        if(length > best) {
+            best = length;
+            vector3[0] = c[0];
+            vector3[1] = c[1];
+            vector3[2] = c[2];
+        }
+    }
+    double length = sqrt(best);
+    if(length < 1e-300) {
+        // two equal small eigenvalues: any vector orthogonal to the dominant direction will do
+        vector3[0] = 0;
+        vector3[1] = 0;
+        vector3[2] = 1;
+        return lambda;
+    }
+    for(int i = 0; i < 3; i++)
+        vector3[i] /= length;
+    return lambda;
+}
+
+// Total least squares: the plane through the centroid normal to the direction of least variance.
+plane_hypothesis plane_from_moments_orthogonal(const plane_moments &moments, long inliers){
+    double cx = moments.x / moments.n, cy = moments.y / moments.n, cz = moments.z / moments.n;
+    double covariance[3][3] = {{moments.xx / moments.n - cx * cx, moments.xy / moments.n - cx * cy, moments.xz / moments.n - cx * cz},
+                               {0, moments.yy / moments.n - cy * cy, moments.yz / moments.n - cy * cz},
+                               {0, 0, moments.zz / moments.n - cz * cz}};
+    covariance[1][0] = covariance[0][1];
+    covariance[2][0] = covariance[0][2];
+    covariance[2][1] = covariance[1][2];
+    double normal[3];
+    smallest_eigenvector(covariance, normal);
+    plane_hypothesis plane = {normal[0], normal[1], normal[2], -(normal[0] * cx + normal[1] * cy + normal[2] * cz), inliers, false};
+    return plane;
+}
+
+// z = f(x, y) is ill-posed for steep planes (walls); those keep the orthogonal fit.
+plane_hypothesis plane_from_moments_any(const plane_moments &moments, long inliers){
+    plane_hypothesis orthogonal = plane_from_moments_orthogonal(moments, inliers);
+    if(fabs(orthogonal.c) < 0.3)
+        return orthogonal;
+    return plane_from_moments(moments, inliers);
+}
+
+// Least-squares fit over the closest half of the cloud. The residual and index arrays live in the context arena.
+plane_hypothesis refine_plane_by_closest_half(const vector<point3d> &points_cloud, const plane_hypothesis &most_fitted,
+                                              fit_context &context){
+    vector<point3d>::size_type n = points_cloud.size();
+    double *distances = context.arena.allocate_array<double>(n);
+    vector<point3d>::size_type *order = context.arena.allocate_array<vector<point3d>::size_type>(n);
+    // squared distances order the points the same way and need neither sqrt nor fabs
+    plane_residuals(points_cloud, most_fitted, RESIDUAL_SQUARED, distances);
+    for(vector<point3d>::size_type i = 0; i < n; i++)
+        order[i] = i;
+    vector<point3d>::size_type half = n/2;
+    nth_element(order, order + half, order + n,
+                [distances](vector<point3d>::size_type l, vector<point3d>::size_type r){ return distances[l] < distances[r]; });
+
+    plane_moments moments = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    for(vector<point3d>::size_type k = 0; k < half; k++)
+        add_point_to_moments(moments, points_cloud[order[k]]);
+    return plane_from_moments_any(moments, most_fitted.inliers);
+}
+
+// Least-squares fit over the consensus set of the most fitted plane, read straight from its mask.
+plane_hypothesis refine_plane_by_inlier_mask(const vector<point3d> &points_cloud, const inlier_mask &mask){
+    plane_moments moments = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    for(vector<point3d>::size_type w = 0; w < mask_words(mask.points); w++) {
+        uint64_t bits = mask.words[w];
+        while(bits) {
+            add_point_to_moments(moments, points_cloud[w * 64 + __builtin_ctzll(bits)]);
+            bits &= bits - 1;
+        }
+    }
+    return plane_from_moments_any(moments, mask_count(mask));
+}
+
+// Below this many points per worker a pass runs on the calling thread (and does not allocate).
+const vector<point3d>::size_type PARALLEL_CHUNK_MIN = 1 << 16;
+
+unsigned worker_count(vector<point3d>::size_type n){
+    unsigned hardware = thread::hardware_concurrency();
+    vector<point3d>::size_type by_size = n / PARALLEL_CHUNK_MIN;
+    if(hardware == 0)
+        hardware = 1;
+    if(by_size < 1)
+        by_size = 1;
+    return by_size < hardware ? by_size : hardware;
+}
+
+// Calls function(chunk, begin, end) for `chunks` contiguous ranges of [0, n), one thread per range.
+template <typename Function>
+void parallel_for_chunks(vector<point3d>::size_type n, unsigned chunks, Function function){
+    if(chunks <= 1) {
+        function(0u, vector<point3d>::size_type(0), n);
+        return;
+    }
+    vector<thread> workers;
+    for(unsigned chunk = 0; chunk < chunks; chunk++)
+        workers.push_back(thread(function, chunk, n * chunk / chunks, n * (chunk + 1) / chunks));
+    for(unsigned chunk = 0; chunk < chunks; chunk++)
+        workers[chunk].join();
+}
+
+enum search_engine { ENGINE_TRIPLETS, ENGINE_HOUGH, ENGINE_REGIONS };
+
+enum refinement_mode { REFINE_CLOSEST_HALF, REFINE_INLIER_MASK, REFINE_HUBER, REFINE_TUKEY };
+
+// Modes that start from the consensus set of the search winner; their search scores true distances.
+bool refines_consensus_set(refinement_mode mode){
+    return mode == REFINE_INLIER_MASK || mode == REFINE_HUBER || mode == REFINE_TUKEY;
+}
+
+struct fit_options
+{
+    search_engine engine = ENGINE_TRIPLETS;
+    refinement_mode refinement = REFINE_CLOSEST_HALF;
+    int irls_max_iterations = 50;
+    double irls_tolerance = 1e-9;
+    int pyramid_levels = 0;
+    double voxel_size = 0;
+    int pyramid_candidates = 8;
+    long hough_samples = 200000;
+    int hough_theta_bins = 90;
+    double hough_rho_step = 0;
+    int hough_peaks = 8;
+    int region_neighbors = 16;
+    double region_angle = 10;
+    long region_min_points = 50;
+    int shard_batches = 4;
+    int shard_batch_size = 256;
+    unsigned seed = 1;
+};
+
+// Standard 95%-efficiency tuning constants, in units of the robust residual scale.
+const double HUBER_K = 1.345;
+const double TUKEY_C = 4.685;
+
+// Median absolute residual of the consensus set (residuals within p) scaled to a
+// normal-consistent sigma; O(N) selection on a scratch copy. Over the whole cloud the median
+// would be an outlier's once they are the majority. Falls back to p below three points.
+double robust_scale(const double *absolute_residuals, vector<point3d>::size_type n, double p, double *scratch){
+    vector<point3d>::size_type m = 0;
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        scratch[m] = absolute_residuals[i];
+        m += absolute_residuals[i] <= p;
+    }
+    if(m < 3)
+        return p;
+    nth_element(scratch, scratch + m / 2, scratch + m);
+    return 1.4826 * scratch[m / 2];
+}
+
+// Branch-free weight loops over the residual array, so they vectorize. The Huber weight never
+// reaches zero, and a majority of far outliers would drag the fit however good the start, so
+// points beyond `reject` (outside the consensus set) are skipped.
+void huber_weights(const double *absolute_residuals, vector<point3d>::size_type n, double k, double reject, double *weights){
+    for(vector<point3d>::size_type i = 0; i < n; i++)
+        weights[i] = (absolute_residuals[i] <= reject) * k / max(absolute_residuals[i], k);
+}
+
+void tukey_weights(const double *absolute_residuals, vector<point3d>::size_type n, double c, double *weights){
+    double inverse_c2 = 1 / (c * c);
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        double t = max(0.0, 1 - absolute_residuals[i] * absolute_residuals[i] * inverse_c2);
+        weights[i] = t * t;
+    }
+}
+
+// Iteratively reweighted least squares starting from the least-squares fit of the search
+// winner's consensus set, a trimmed estimate, so a monotone Huber weight does not start from a
+// plane the outliers can drag. Every point contributes according to its M-estimator weight, so
+// no fixed trimming fraction is assumed. Stops when the unit plane moves less than
+// irls_tolerance between iterations.
+plane_hypothesis refine_plane_by_irls(const vector<point3d> &points_cloud, const plane_hypothesis &most_fitted,
+                                      const inlier_mask &consensus, double p, const fit_options &options,
+                                      fit_context &context){
+    if(most_fitted.degenerate)
+        throw domain_error("Error: the search found no plane.");
+    vector<point3d>::size_type n = points_cloud.size();
+    double *residuals = context.arena.allocate_array<double>(n);
+    double *weights = context.arena.allocate_array<double>(n);
+    unsigned chunks = worker_count(n);
+    plane_moments *partial = context.arena.allocate_array<plane_moments>(chunks);
+
+    plane_hypothesis current = normalize_plane(mask_count(consensus) >= 3 ? refine_plane_by_inlier_mask(points_cloud, consensus)
+                                                                           : most_fitted);
+    for(int iteration = 0; iteration < options.irls_max_iterations; iteration++) {
+        plane_residuals(points_cloud, current, RESIDUAL_ABSOLUTE, residuals);
+        double scale = robust_scale(residuals, n, p, weights);
+        if(scale < EPS)
+            break;
+        if(options.refinement == REFINE_HUBER)
+            huber_weights(residuals, n, HUBER_K * scale, p, weights);
+        else
+            tukey_weights(residuals, n, TUKEY_C * scale, weights);
+
+        parallel_for_chunks(n, chunks, [&](unsigned chunk, vector<point3d>::size_type begin, vector<point3d>::size_type end){
+            plane_moments moments = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            for(vector<point3d>::size_type i = begin; i < end; i++)
+                add_point_to_moments(moments, points_cloud[i], weights[i]);
+            partial[chunk] = moments;
+        });
+        plane_moments moments = partial[0];
+        for(unsigned chunk = 1; chunk < chunks; chunk++)
+            merge_moments(moments, partial[chunk]);
+
+        plane_hypothesis next = normalize_plane(plane_from_moments_any(moments, most_fitted.inliers));
+        // orient the new normal like the old one so the two planes can be compared component-wise
+        if(next.a * current.a + next.b * current.b + next.c * current.c < 0) {
+            next.a = -next.a;
+            next.b = -next.b;
+            next.c = -next.c;
+            next.d = -next.d;
+        }
+        double change = fabs(next.a - current.a) + fabs(next.b - current.b) + fabs(next.c - current.c) + fabs(next.d - current.d);
+        current = next;
+        if(change < options.irls_tolerance)
+            break;
+    }
+    // back to the a*x+b*y+z+d = 0 form of the other refinements, unless the plane is a wall
+    current.inliers = most_fitted.inliers;
+    if(fabs(current.c) < 0.3)
+        return current;
+    plane_hypothesis refined = {current.a / current.c, current.b / current.c, 1, current.d / current.c, most_fitted.inliers, false};
+    return refined;
+}
+
+// `consensus` is the search winner's inlier mask when the search kept it; otherwise the
+// consensus-set modes score `most_fitted` here.
+plane_hypothesis refine_plane(const vector<point3d> &points_cloud, const plane_hypothesis &most_fitted, double p,
+                              const inlier_mask *consensus, const fit_options &options, fit_context &context){
+    inlier_mask scored;
+    if(refines_consensus_set(options.refinement) && !consensus) {
+        scored = allocate_inlier_mask(points_cloud.size(), context.arena);
+        score_plane_with_mask(points_cloud, most_fitted, p, scored);
+        consensus = &scored;
+    }
+    if(options.refinement == REFINE_INLIER_MASK) {
+        inlier_mask mask = *consensus;
+        // a hypothesis through three noisy points is tilted, and its consensus set is a band of
+        // the surface; fitting and rescoring again takes in the rest of it
+        plane_hypothesis refined = refine_plane_by_inlier_mask(points_cloud, mask);
+        mask = allocate_inlier_mask(points_cloud.size(), context.arena);
+        long inliers = score_plane_with_mask(points_cloud, refined, p, mask);
+        for(int pass = 0; pass < 2 && inliers >= 3; pass++) {
+            plane_hypothesis next = refine_plane_by_inlier_mask(points_cloud, mask);
+            inlier_mask next_mask = allocate_inlier_mask(points_cloud.size(), context.arena);
+            long rescored = score_plane_with_mask(points_cloud, next, p, next_mask);
+            if(rescored <= inliers)
+                break;
+            refined = next;
+            mask = next_mask;
+            inliers = rescored;
+        }
+        return refined;
+    }
+    if(options.refinement == REFINE_HUBER || options.refinement == REFINE_TUKEY)
+        return refine_plane_by_irls(points_cloud, most_fitted, *consensus, p, options, context);
+    return refine_plane_by_closest_half(points_cloud, most_fitted, context);
+}
+
+// Morton (Z-order) code of integer voxel coordinates; nearby voxels get nearby keys.
+uint64_t spread_bits_21(uint64_t v){
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+uint64_t morton_key(uint64_t ix, uint64_t iy, uint64_t iz){
+    return spread_bits_21(ix) | spread_bits_21(iy) << 1 | spread_bits_21(iz) << 2;
+}
+
+// Randomized Hough transform. A plane n.x = rho with n on the upper hemisphere is binned as
+// (theta, phi, rho); the number of phi bins shrinks with sin(theta), so every cell covers about
+// the same solid angle (the "ball" layout). Only voted cells exist, in a hash table keyed by
+// the packed bin indices.
+struct hough_space
+{
+    int theta_bins;
+    double theta_step;
+    double rho_step;
+};
+
+int hough_phi_bins(const hough_space &space, int theta_bin){
+    double theta = (theta_bin + 0.5) * space.theta_step;
+    return max(1, int(ceil(4 * space.theta_bins * sin(theta))));
+}
+
+uint64_t hough_cell(const hough_space &space, const plane_hypothesis &plane){
+    plane_hypothesis unit = normalize_plane(plane);
+    if(unit.c < 0 || (unit.c == 0 && (unit.b < 0 || (unit.b == 0 && unit.a < 0)))) {
+        unit.a = -unit.a;
+        unit.b = -unit.b;
+        unit.c = -unit.c;
+        unit.d = -unit.d;
+    }
+    double theta = acos(min(1.0, unit.c));
+    double phi = atan2(unit.b, unit.a);
+    if(phi < 0)
+        phi += 2 * M_PI;
+    int theta_bin = min(space.theta_bins - 1, int(theta / space.theta_step));
+    int phi_bins = hough_phi_bins(space, theta_bin);
+    int phi_bin = min(phi_bins - 1, int(phi / (2 * M_PI) * phi_bins));
+    int64_t rho_bin = int64_t(floor(-unit.d / space.rho_step));
+    return uint64_t(theta_bin) << 48 | uint64_t(phi_bin) << 32 | uint32_t(int32_t(rho_bin));
+}
+
+plane_hypothesis hough_cell_plane(const hough_space &space, uint64_t cell){
+    int theta_bin = int(cell >> 48);
+    int phi_bin = int((cell >> 32) & 0xffff);
+    int32_t rho_bin = int32_t(uint32_t(cell));
+    double theta = (theta_bin + 0.5) * space.theta_step;
+    double phi = (phi_bin + 0.5) * 2 * M_PI / hough_phi_bins(space, theta_bin);
+    plane_hypothesis plane = {sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta), -(rho_bin + 0.5) * space.rho_step, 0, false};
+    return plane;
+}
+
+// Vote table in arena memory: open addressing with linear probing over a power-of-two array of
+// (cell, votes) slots, at most half full. HOUGH_EMPTY marks a free slot; no packed cell uses it.
+const uint64_t HOUGH_EMPTY = ~uint64_t(0);
+
+struct hough_slot
+{
+    uint64_t cell;
+    long votes;
+};
+
+struct hough_table
+{
+    hough_slot *slots;
+    uint64_t mask;
+};
+
+hough_table allocate_hough_table(uint64_t entries, scratch_arena &arena){
+    uint64_t capacity = 16;
+    while(capacity < 2 * entries)
+        capacity <<= 1;
+    hough_table table = {arena.allocate_array<hough_slot>(capacity), capacity - 1};
+    for(uint64_t i = 0; i < capacity; i++) {
+        table.slots[i].cell = HOUGH_EMPTY;
+        table.slots[i].votes = 0;
+    }
+    return table;
+}
+
+void hough_vote(hough_table &table, uint64_t cell, long votes){
+    // the packed bins are far from uniform, so mix them before taking the low bits
+    uint64_t hash = cell * 0x9e3779b97f4a7c15ULL;
+    uint64_t slot = (hash ^ hash >> 29) & table.mask;
+    while(table.slots[slot].cell != cell && table.slots[slot].cell != HOUGH_EMPTY)
+        slot = (slot + 1) & table.mask;
+    table.slots[slot].cell = cell;
+    table.slots[slot].votes += votes;
+}
+
+// Votes are drawn by this many independently seeded streams whatever the thread count, so a
+// fixed seed gives the same accumulator on every machine.
+const unsigned HOUGH_STREAMS = 16;
+
+// Detects up to hough_peaks planes. Triplets are drawn close together in Morton order so that
+// in a scene with many planes most of them land on one surface. Every stream votes into its
+// own table and they are merged after the join, so voting takes no locks. Each peak is refined
+// by least squares, first over the points within one rho step of its cell and then over those
+// within p of the fit. A peak whose inlier mask mostly overlaps the union of the masks already
+// accepted is dropped. Only the 4 * hough_peaks strongest cells with at least two votes are
+// examined. The planes go to `planes` (empty on entry), sorted by the number of points within p.
+void detect_planes_hough(const vector<point3d> &points_cloud, double p, const fit_options &options, fit_context &context,
+                         vector<plane_hypothesis> &planes){
+    vector<point3d>::size_type n = points_cloud.size();
+    if(n < 3)
+        return;
+
+    point3d low = points_cloud[0], high = points_cloud[0];
+    for(vector<point3d>::size_type i = 1; i < n; i++) {
+        low.x = min(low.x, points_cloud[i].x);  high.x = max(high.x, points_cloud[i].x);
+        low.y = min(low.y, points_cloud[i].y);  high.y = max(high.y, points_cloud[i].y);
+        low.z = min(low.z, points_cloud[i].z);  high.z = max(high.z, points_cloud[i].z);
+    }
+    double diagonal = sqrt(pow(high.x - low.x, 2) + pow(high.y - low.y, 2) + pow(high.z - low.z, 2));
+    double extent = max(high.x - low.x, max(high.y - low.y, high.z - low.z));
+    hough_space space = {options.hough_theta_bins, M_PI / 2 / options.hough_theta_bins,
+                         options.hough_rho_step > 0 ? options.hough_rho_step : diagonal / 200};
+    if(space.rho_step <= 0)
+        space.rho_step = 1;
+
+    double cell = max(extent / 1024, EPS);
+    uint64_t *keys = context.arena.allocate_array<uint64_t>(n);
+    vector<point3d>::size_type *order = context.arena.allocate_array<vector<point3d>::size_type>(n);
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        keys[i] = morton_key(uint64_t((points_cloud[i].x - low.x) / cell), uint64_t((points_cloud[i].y - low.y) / cell),
+                             uint64_t((points_cloud[i].z - low.z) / cell));
+        order[i] = i;
+    }
+    sort(order, order + n, [keys](vector<point3d>::size_type l, vector<point3d>::size_type r){ return keys[l] < keys[r]; });
+
+    vector<point3d>::size_type samples = max(0L, options.hough_samples);
+    hough_table *tables = context.arena.allocate_array<hough_table>(HOUGH_STREAMS);
+    for(unsigned stream = 0; stream < HOUGH_STREAMS; stream++)
+        tables[stream] = allocate_hough_table(samples / HOUGH_STREAMS + 1, context.arena);
+    vector<point3d>::size_type window = min<vector<point3d>::size_type>(n - 1, 32);
+    unsigned threads = min(HOUGH_STREAMS, worker_count(samples));
+    parallel_for_chunks(HOUGH_STREAMS, threads, [&](unsigned, vector<point3d>::size_type first_stream,
+                                                    vector<point3d>::size_type last_stream){
+        for(vector<point3d>::size_type stream = first_stream; stream < last_stream; stream++) {
+            mt19937_64 random(options.seed + stream);
+            uniform_int_distribution<vector<point3d>::size_type> first(0, n - 1);
+            uniform_int_distribution<vector<point3d>::size_type> offset(1, window);
+            hough_table &votes = tables[stream];
+            for(vector<point3d>::size_type sample = samples * stream / HOUGH_STREAMS;
+                sample < samples * (stream + 1) / HOUGH_STREAMS; sample++) {
+                vector<point3d>::size_type i = first(random);
+                const point3d &p1 = points_cloud[order[i]];
+                const point3d &p2 = points_cloud[order[(i + offset(random)) % n]];
+                const point3d &p3 = points_cloud[order[(i + offset(random)) % n]];
+                plane_hypothesis plane = plane_equation_coefficients_by_3points(p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, p3.x, p3.y, p3.z);
+                if(!plane.degenerate)
+                    hough_vote(votes, hough_cell(space, plane), 1);
+            }
+        }
+    });
+    hough_table votes = allocate_hough_table(samples, context.arena);
+    for(unsigned stream = 0; stream < HOUGH_STREAMS; stream++) {
+        for(uint64_t slot = 0; slot <= tables[stream].mask; slot++) {
+            if(tables[stream].slots[slot].cell != HOUGH_EMPTY)
+                hough_vote(votes, tables[stream].slots[slot].cell, tables[stream].slots[slot].votes);
+        }
+    }
+
+    vector<point3d>::size_type cells = 0;
+    pair<long, uint64_t> *peaks = context.arena.allocate_array<pair<long, uint64_t>>(votes.mask + 1);
+    for(uint64_t slot = 0; slot <= votes.mask; slot++) {
+        if(votes.slots[slot].cell != HOUGH_EMPTY)
+            peaks[cells++] = make_pair(votes.slots[slot].votes, votes.slots[slot].cell);
+    }
+    sort(peaks, peaks + cells, [](const pair<long, uint64_t> &l, const pair<long, uint64_t> &r){
+        return l.first > r.first || (l.first == r.first && l.second < r.second);
+    });
+
+    double *distances = context.arena.allocate_array<double>(n);
+    inlier_mask claimed = allocate_inlier_mask(n, context.arena);
+    double close = cos(2 * space.theta_step);
+    // every candidate costs a few passes over the cloud; past the strongest cells the rest are noise
+    vector<point3d>::size_type candidates = min<vector<point3d>::size_type>(cells, 4 * max(options.hough_peaks, 1));
+    for(vector<point3d>::size_type k = 0; k < candidates && int(planes.size()) < options.hough_peaks; k++) {
+        if(peaks[k].first < 2)
+            break;
+        plane_hypothesis peak = hough_cell_plane(space, peaks[k].second);
+        // the neighbourhood of an accepted peak collects votes from the same surface
+        bool suppressed = false;
+        for(vector<plane_hypothesis>::size_type j = 0; j < planes.size() && !suppressed; j++) {
+            plane_hypothesis unit = normalize_plane(planes[j]);
+            double cosine = peak.a * unit.a + peak.b * unit.b + peak.c * unit.c;
+            double offset = cosine < 0 ? peak.d + unit.d : peak.d - unit.d;
+            suppressed = fabs(cosine) > close && fabs(offset) < 3 * space.rho_step;
+        }
+        if(suppressed)
+            continue;
+
+        // the cell is only as precise as its bins; the slab around it finds the surface, the
+        // passes within p fit it
+        plane_hypothesis refined = peak;
+        double threshold = max(space.rho_step, p);
+        long inliers = 0;
+        for(int pass = 0; pass < 3; pass++) {
+            plane_residuals(points_cloud, refined, RESIDUAL_ABSOLUTE, distances);
+            plane_moments moments = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            inliers = 0;
+            for(vector<point3d>::size_type i = 0; i < n; i++) {
+                if(distances[i] <= threshold) {
+                    add_point_to_moments(moments, points_cloud[i]);
+                    inliers++;
+                }
+            }
+            if(inliers < 3)
+                break;
+            refined = plane_from_moments_any(moments, inliers);
+            threshold = p;
+        }
+        if(inliers < 3)
+            continue;
+        // a peak whose consensus set mostly belongs to planes already found is another view of them
+        inlier_mask mask = allocate_inlier_mask(n, context.arena);
+        refined.inliers = score_plane_with_mask(points_cloud, refined, p, mask);
+        if(2 * mask_overlap(mask, claimed) > refined.inliers)
+            continue;
+        mask_union(claimed, mask, claimed);
+        planes.push_back(refined);
+    }
+    sort(planes.begin(), planes.end(), [](const plane_hypothesis &l, const plane_hypothesis &r){ return l.inliers > r.inliers; });
+}
+
+// Implicit balanced k-d tree: `order` is a permutation of the cloud in which the median of every
+// range [lo, hi) splits it on axis[(lo + hi) / 2]. Ranges of at most KD_LEAF_SIZE points are leaves.
+// `sorted` holds the points themselves in tree order, so a search walks contiguous memory.
+const vector<point3d>::size_type KD_LEAF_SIZE = 8;
+
+struct kd_tree
+{
+    const point3d *points;
+    uint32_t *order;
+    unsigned char *axis;
+    point3d *sorted;
+};
+
+double coordinate(const point3d &point, int axis){
+    return axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+}
+
+void build_kd_range(kd_tree &tree, vector<point3d>::size_type lo, vector<point3d>::size_type hi){
+    if(hi - lo <= KD_LEAF_SIZE)
+        return;
+    const point3d *points = tree.points;
+    point3d low = points[tree.order[lo]], high = low;
+    for(vector<point3d>::size_type i = lo + 1; i < hi; i++) {
+        const point3d &q = points[tree.order[i]];
+        low.x = min(low.x, q.x);  high.x = max(high.x, q.x);
+        low.y = min(low.y, q.y);  high.y = max(high.y, q.y);
+        low.z = min(low.z, q.z);  high.z = max(high.z, q.z);
+    }
+    int axis = 0;
+    if(high.y - low.y > high.x - low.x)
+        axis = 1;
+    if(high.z - low.z > coordinate(high, axis) - coordinate(low, axis))
+        axis = 2;
+    vector<point3d>::size_type mid = (lo + hi) / 2;
+    nth_element(tree.order + lo, tree.order + mid, tree.order + hi,
+                [points, axis](uint32_t l, uint32_t r){ return coordinate(points[l], axis) < coordinate(points[r], axis); });
+    tree.axis[mid] = axis;
+    build_kd_range(tree, lo, mid);
+    build_kd_range(tree, mid + 1, hi);
+}
+
+kd_tree build_kd_tree(const vector<point3d> &points_cloud, scratch_arena &arena){
+    kd_tree tree = {points_cloud.data(), arena.allocate_array<uint32_t>(points_cloud.size()),
+                    arena.allocate_array<unsigned char>(points_cloud.size()), arena.allocate_array<point3d>(points_cloud.size())};
+    for(vector<point3d>::size_type i = 0; i < points_cloud.size(); i++)
+        tree.order[i] = uint32_t(i);
+    build_kd_range(tree, 0, points_cloud.size());
+    for(vector<point3d>::size_type i = 0; i < points_cloud.size(); i++)
+        tree.sorted[i] = points_cloud[tree.order[i]];
+    return tree;
+}
+
+// k nearest candidates found so far, kept as a max-heap on squared distance.
+struct neighbor_heap
+{
+    pair<double, uint32_t> *items;
+    int size;
+    int capacity;
+};
+
+void offer_neighbor(neighbor_heap &heap, double distance, uint32_t index){
+    if(heap.size < heap.capacity) {
+        heap.items[heap.size++] = make_pair(distance, index);
+        push_heap(heap.items, heap.items + heap.size);
+    } else if(distance < heap.items[0].first) {
+        pop_heap(heap.items, heap.items + heap.size);
+        heap.items[heap.size - 1] = make_pair(distance, index);
+        push_heap(heap.items, heap.items + heap.size);
+    }
+}
+
+void search_kd_range(const kd_tree &tree, vector<point3d>::size_type lo, vector<point3d>::size_type hi,
+                     const point3d &query, neighbor_heap &heap){
+    if(hi - lo <= KD_LEAF_SIZE) {
+        for(vector<point3d>::size_type i = lo; i < hi; i++) {
+            const point3d &q = tree.sorted[i];
+            offer_neighbor(heap, (q.x - query.x) * (q.x - query.x) + (q.y - query.y) * (q.y - query.y) + (q.z - query.z) * (q.z - query.z),
+                           tree.order[i]);
+        }
+        return;
+    }
+    vector<point3d>::size_type mid = (lo + hi) / 2;
+    const point3d &median = tree.sorted[mid];
+    offer_neighbor(heap, (median.x - query.x) * (median.x - query.x) + (median.y - query.y) * (median.y - query.y)
+                         + (median.z - query.z) * (median.z - query.z), tree.order[mid]);
+    double difference = coordinate(query, tree.axis[mid]) - coordinate(median, tree.axis[mid]);
+    if(difference < 0) {
+        search_kd_range(tree, lo, mid, query, heap);
+        if(heap.size < heap.capacity || difference * difference < heap.items[0].first)
+            search_kd_range(tree, mid + 1, hi, query, heap);
+    } else {
+        search_kd_range(tree, mid + 1, hi, query, heap);
+        if(heap.size < heap.capacity || difference * difference < heap.items[0].first)
+            search_kd_range(tree, lo, mid, query, heap);
+    }
+}
+
+// Region growing over k-NN normals. Seeds are taken in order of increasing surface variation;
+// a neighbour joins the region when its normal is within region_angle degrees of the seed's
+// and it lies within p of the seed's tangent plane. Each region with at least region_min_points
+// points then takes in the unclaimed neighbours within p of its least-squares plane and is
+// fitted again. The planes go to `planes` (empty on entry), sorted by size, and labels[i] gets
+// the index of the point's region there or -1.
+void segment_planar_regions(const vector<point3d> &points_cloud, double p, const fit_options &options, fit_context &context,
+                            vector<plane_hypothesis> &planes, int *labels){
+    vector<point3d>::size_type n = points_cloud.size();
+    int k = int(min<vector<point3d>::size_type>(options.region_neighbors, n));
+    // a normal needs at least three neighbours
+    if(n < 3 || k < 3 || n > UINT32_MAX)
+        return;
+
+    kd_tree tree = build_kd_tree(points_cloud, context.arena);
+    uint32_t *neighbors = context.arena.allocate_array<uint32_t>(n * k);
+    double *normals = context.arena.allocate_array<double>(n * 3);
+    double *variation = context.arena.allocate_array<double>(n);
+    unsigned chunks = worker_count(n);
+    pair<double, uint32_t> *heaps = context.arena.allocate_array<pair<double, uint32_t>>(chunks * k);
+
+    // queries are batched in tree order, so consecutive searches visit the same nodes
+    parallel_for_chunks(n, chunks, [&](unsigned chunk, vector<point3d>::size_type begin, vector<point3d>::size_type end){
+        neighbor_heap heap = {heaps + chunk * k, 0, k};
+        for(vector<point3d>::size_type position = begin; position < end; position++) {
+            vector<point3d>::size_type i = tree.order[position];
+            heap.size = 0;
+            search_kd_range(tree, 0, n, tree.sorted[position], heap);
+            point3d mean = {0, 0, 0};
+            for(int j = 0; j < heap.size; j++) {
+                const point3d &q = points_cloud[heap.items[j].second];
+                neighbors[i * k + j] = heap.items[j].second;
+                mean.x += q.x;
+                mean.y += q.y;
+                mean.z += q.z;
+            }
+            mean.x /= heap.size;
+            mean.y /= heap.size;
+            mean.z /= heap.size;
+            double covariance[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+            for(int j = 0; j < heap.size; j++) {
+                const point3d &q = points_cloud[heap.items[j].second];
+                double d[3] = {q.x - mean.x, q.y - mean.y, q.z - mean.z};
+                for(int r = 0; r < 3; r++) {
+                    for(int c = r; c < 3; c++)
+                        covariance[r][c] += d[r] * d[c];
+                }
+            }
+            covariance[1][0] = covariance[0][1];
+            covariance[2][0] = covariance[0][2];
+            covariance[2][1] = covariance[1][2];
+            double lambda = smallest_eigenvector(covariance, normals + i * 3);
+            double trace = covariance[0][0] + covariance[1][1] + covariance[2][2];
+            variation[i] = trace > 0 ? lambda / trace : 0;
+        }
+    });
+
+    uint32_t *seeds = context.arena.allocate_array<uint32_t>(n);
+    uint32_t *queue = context.arena.allocate_array<uint32_t>(n);
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        seeds[i] = uint32_t(i);
+        labels[i] = -1;
+    }
+    sort(seeds, seeds + n, [variation](uint32_t l, uint32_t r){ return variation[l] < variation[r]; });
+
+    double cos_angle = cos(options.region_angle * M_PI / 180);
+    // every kept region has at least three points
+    pair<long, int> *sizes = context.arena.allocate_array<pair<long, int>>(n / 3);
+    int regions = 0;
+    for(vector<point3d>::size_type s = 0; s < n; s++) {
+        uint32_t seed = seeds[s];
+        if(labels[seed] != -1)
+            continue;
+        const double *normal = normals + seed * 3;
+        const point3d &origin = points_cloud[seed];
+        vector<point3d>::size_type head = 0, tail = 0;
+        queue[tail++] = seed;
+        labels[seed] = regions;
+        while(head < tail) {
+            uint32_t current = queue[head++];
+            for(int j = 0; j < k; j++) {
+                uint32_t next = neighbors[current * k + j];
+                if(labels[next] != -1)
+                    continue;
+                const double *m = normals + next * 3;
+                const point3d &q = points_cloud[next];
+                double offset = normal[0] * (q.x - origin.x) + normal[1] * (q.y - origin.y) + normal[2] * (q.z - origin.z);
+                if(fabs(normal[0] * m[0] + normal[1] * m[1] + normal[2] * m[2]) >= cos_angle && fabs(offset) <= p) {
+                    labels[next] = regions;
+                    queue[tail++] = next;
+                }
+            }
+        }
+        if(long(tail) < options.region_min_points || tail < 3) {
+            // too small to be a patch; these points stay unlabelled and are not used as seeds again
+            for(vector<point3d>::size_type i = 0; i < tail; i++)
+                labels[queue[i]] = -2;
+            continue;
+        }
+        // a seed normal that is off by a little keeps only a band of the surface within p of its
+        // tangent plane; the region is grown again from its own fit to take in the rest
+        plane_moments grown = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        for(vector<point3d>::size_type i = 0; i < tail; i++)
+            add_point_to_moments(grown, points_cloud[queue[i]]);
+        plane_hypothesis fitted = plane_from_moments_orthogonal(grown, long(tail));
+        for(head = 0; head < tail; head++) {
+            uint32_t current = queue[head];
+            for(int j = 0; j < k; j++) {
+                uint32_t next = neighbors[current * k + j];
+                if(labels[next] >= 0)
+                    continue;
+                const point3d &q = points_cloud[next];
+                if(fabs(fitted.a * q.x + fitted.b * q.y + fitted.c * q.z + fitted.d) <= p) {
+                    labels[next] = regions;
+                    queue[tail++] = next;
+                }
+            }
+        }
+        sizes[regions] = make_pair(long(tail), regions);
+        regions++;
+    }
+
+    sort(sizes, sizes + regions, [](const pair<long, int> &l, const pair<long, int> &r){
+        return l.first > r.first || (l.first == r.first && l.second < r.second);
+    });
+    int *rank = context.arena.allocate_array<int>(regions);
+    for(int r = 0; r < regions; r++)
+        rank[sizes[r].second] = r;
+    plane_moments *moments = context.arena.allocate_array<plane_moments>(regions);
+    for(int r = 0; r < regions; r++) {
+        plane_moments empty = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        moments[r] = empty;
+    }
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        labels[i] = labels[i] >= 0 ? rank[labels[i]] : -1;
+        if(labels[i] >= 0)
+            add_point_to_moments(moments[labels[i]], points_cloud[i]);
+    }
+    for(int r = 0; r < regions; r++)
+        planes.push_back(plane_from_moments_any(moments[r], sizes[r].first));
+}
+
+// Search and refinement on an already loaded cloud. All temporaries are released by one arena reset;
+// context.detected and context.labels keep their capacity, so repeated fits do not allocate.
+// The multi-plane engines fit every plane on its own inliers, so their strongest plane is the
+// result as it is; a global refinement would pull in the other surfaces.
+plane_hypothesis fit_plane(const vector<point3d> &points_cloud, double p, const fit_options &options, fit_context &context){
+    context.detected.clear();
+    context.labels.clear();
+    if(options.engine == ENGINE_TRIPLETS && refines_consensus_set(options.refinement)) {
+        inlier_mask consensus = allocate_inlier_mask(points_cloud.size(), context.arena);
+        plane_hypothesis most_fitted = find_most_fitted_plane_with_mask(points_cloud, p, consensus, context.arena);
+        plane_hypothesis refined = refine_plane(points_cloud, most_fitted, p, &consensus, options, context);
+        context.arena.reset();
+        return refined;
+    }
+    if(options.engine == ENGINE_TRIPLETS) {
+        plane_hypothesis most_fitted = find_most_fitted_plane(points_cloud, p);
+        plane_hypothesis refined = refine_plane(points_cloud, most_fitted, p, 0, options, context);
+        context.arena.reset();
+        return refined;
+    }
+    if(options.engine == ENGINE_HOUGH) {
+        detect_planes_hough(points_cloud, p, options, context, context.detected);
+    } else {
+        context.labels.resize(points_cloud.size());
+        segment_planar_regions(points_cloud, p, options, context, context.detected, context.labels.data());
+    }
+    context.arena.reset();
+    if(context.detected.empty())
+        throw domain_error("Error: the search found no plane.");
+    return context.detected[0];
+}
+
+// Voxel-downsampled copies of the cloud, one weighted centroid per occupied voxel. levels[0]
+// is the finest; every next level doubles the voxel size. Voxels are keyed by morton_key of
+// their integer coordinates, so a coarse key is the fine key shifted right by 3 and every
+// level can be built from the sorted level below it in one linear pass.
+struct voxel_level
+{
+    double voxel_size;
+    vector<uint64_t> keys;
+    vector<point3d> centroids;
+    vector<double> weights;
+};
+
+struct voxel_pyramid
+{
+    vector<voxel_level> levels;
+};
+
+struct voxel_sum
+{
+    double x, y, z, weight;
+};
+
+// Turns key-sorted sums into centroids.
+void finish_voxel_level(const vector<pair<uint64_t, voxel_sum>> &sums, voxel_level &level){
+    level.keys.reserve(sums.size());
+    level.centroids.reserve(sums.size());
+    level.weights.reserve(sums.size());
+    for(vector<pair<uint64_t, voxel_sum>>::size_type i = 0; i < sums.size(); i++) {
+        const voxel_sum &sum = sums[i].second;
+        point3d centroid = {sum.x / sum.weight, sum.y / sum.weight, sum.z / sum.weight};
+        level.keys.push_back(sums[i].first);
+        level.centroids.push_back(centroid);
+        level.weights.push_back(sum.weight);
+    }
+}
+
+// `voxel_size` is the edge of the finest voxels; 0 picks 1/512 of the bounding box diagonal.
+voxel_pyramid build_voxel_pyramid(const vector<point3d> &points_cloud, int levels, double voxel_size){
+    voxel_pyramid pyramid;
+    if(points_cloud.empty() || levels < 1)
+        return pyramid;
+    point3d low = points_cloud[0], high = points_cloud[0];
+    for(vector<point3d>::size_type i = 1; i < points_cloud.size(); i++) {
+        low.x = min(low.x, points_cloud[i].x);  high.x = max(high.x, points_cloud[i].x);
+        low.y = min(low.y, points_cloud[i].y);  high.y = max(high.y, points_cloud[i].y);
+        low.z = min(low.z, points_cloud[i].z);  high.z = max(high.z, points_cloud[i].z);
+    }
+    double extent = max(high.x - low.x, max(high.y - low.y, high.z - low.z));
+    if(voxel_size <= 0)
+        voxel_size = sqrt(pow(high.x - low.x, 2) + pow(high.y - low.y, 2) + pow(high.z - low.z, 2)) / 512;
+    // 21 bits per axis is what a 64-bit Morton key holds
+    voxel_size = max(voxel_size, extent / 2097151);
+    if(voxel_size <= 0)
+        voxel_size = 1;
+
+    unordered_map<uint64_t, voxel_sum> finest;
+    finest.reserve(points_cloud.size());
+    for(vector<point3d>::size_type i = 0; i < points_cloud.size(); i++) {
+        uint64_t key = morton_key(uint64_t((points_cloud[i].x - low.x) / voxel_size),
+                                  uint64_t((points_cloud[i].y - low.y) / voxel_size),
+                                  uint64_t((points_cloud[i].z - low.z) / voxel_size));
+        voxel_sum &sum = finest[key];
+        sum.x += points_cloud[i].x;
+        sum.y += points_cloud[i].y;
+        sum.z += points_cloud[i].z;
+        sum.weight += 1;
+    }
+    vector<pair<uint64_t, voxel_sum>> sums(finest.begin(), finest.end());
+    sort(sums.begin(), sums.end(),
+         [](const pair<uint64_t, voxel_sum> &l, const pair<uint64_t, voxel_sum> &r){ return l.first < r.first; });
+
+    pyramid.levels.resize(levels);
+    pyramid.levels[0].voxel_size = voxel_size;
+    finish_voxel_level(sums, pyramid.levels[0]);
+    for(int level = 1; level < levels; level++) {
+        const voxel_level &finer = pyramid.levels[level - 1];
+        vector<pair<uint64_t, voxel_sum>> coarse;
+        for(vector<point3d>::size_type i = 0; i < finer.centroids.size(); i++) {
+            uint64_t key = finer.keys[i] >> 3;
+            double weight = finer.weights[i];
+            if(coarse.empty() || coarse.back().first != key) {
+                voxel_sum empty = {0, 0, 0, 0};
+                coarse.push_back(make_pair(key, empty));
+            }
+            voxel_sum &sum = coarse.back().second;
+            sum.x += finer.centroids[i].x * weight;
+            sum.y += finer.centroids[i].y * weight;
+            sum.z += finer.centroids[i].z * weight;
+            sum.weight += weight;
+        }
+        pyramid.levels[level].voxel_size = finer.voxel_size * 2;
+        finish_voxel_level(coarse, pyramid.levels[level]);
+    }
+    return pyramid;
+}
+
+// Weighted count of centroids within `threshold` of a unit-normal plane.
+double weighted_support(const voxel_level &level, const plane_hypothesis &unit, double threshold){
+    double support = 0;
+    for(vector<point3d>::size_type i = 0; i < level.centroids.size(); i++) {
+        const point3d &c = level.centroids[i];
+        if(fabs(unit.a * c.x + unit.b * c.y + unit.c * c.z + unit.d) <= threshold)
+            support += level.weights[i];
+    }
+    return support;
+}
+
+// Weighted least squares over the supporting centroids; keeps the candidate if fewer than three
+// of them support it.
+plane_hypothesis refine_candidate_on_level(const voxel_level &level, const plane_hypothesis &unit, double threshold){
+    plane_moments moments = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    long supporting = 0;
+    for(vector<point3d>::size_type i = 0; i < level.centroids.size(); i++) {
+        const point3d &c = level.centroids[i];
+        if(fabs(unit.a * c.x + unit.b * c.y + unit.c * c.z + unit.d) <= threshold) {
+            add_point_to_moments(moments, c, level.weights[i]);
+            supporting++;
+        }
+    }
+    if(supporting < 3)
+        return unit;
+    return normalize_plane(plane_from_moments_any(moments, 0));
+}
+
+// Triplets drawn on the coarsest level. Each is scored against every centroid there, and
+// outliers fill the box, so the level grows with the cloud; a fixed draw keeps the search linear.
+const vector<point3d>::size_type PYRAMID_TOP_TRIPLETS = 2048;
+
+// Coarse-to-fine search: hypotheses come from Morton-adjacent centroid triplets on the coarsest
+// level (every one on a small level, otherwise PYRAMID_TOP_TRIPLETS of them starting at
+// centroids drawn in proportion to their weight, so dense surface voxels are preferred over
+// scattered outliers) and the best few are refined level by level. On every finer level a candidate must keep
+// at least half the support of the best one there, or it is dropped. Only the survivors are
+// scored within p against the full-resolution cloud before the usual refinement step. A level
+// counts centroids within its voxel edge or p, whichever is larger, of a candidate.
+plane_hypothesis fit_plane_coarse_to_fine(const vector<point3d> &points_cloud, const voxel_pyramid &pyramid, double p,
+                                          const fit_options &options, fit_context &context){
+    const voxel_level &coarsest = pyramid.levels.back();
+    int wanted = options.pyramid_candidates;
+    plane_hypothesis *candidates = context.arena.allocate_array<plane_hypothesis>(wanted);
+    double *support = context.arena.allocate_array<double>(wanted);
+    int found = 0;
+
+    vector<point3d>::size_type starts = coarsest.centroids.size() < 3 ? 0 : coarsest.centroids.size() - 2;
+    bool drawn = starts > PYRAMID_TOP_TRIPLETS;
+    double *cumulative = context.arena.allocate_array<double>(starts);
+    double total = 0;
+    for(vector<point3d>::size_type i = 0; i < starts; i++) {
+        total += coarsest.weights[i];
+        cumulative[i] = total;
+    }
+    mt19937_64 random(options.seed);
+    uniform_real_distribution<double> draw(0, total);
+    for(vector<point3d>::size_type t = 0; t < min(starts, PYRAMID_TOP_TRIPLETS); t++) {
+        vector<point3d>::size_type i = t;
+        if(drawn)
+            i = min<vector<point3d>::size_type>(upper_bound(cumulative, cumulative + starts, draw(random)) - cumulative, starts - 1);
+        plane_hypothesis current = make_hypothesis(coarsest.centroids, i);
+        if(current.degenerate)
+            continue;
+        current = normalize_plane(current);
+        double score = weighted_support(coarsest, current, max(coarsest.voxel_size, p));
+        // skip near-copies of a plane already kept; n.x = d and -n.x = -d are the same plane
+        bool duplicate = false;
+        for(int k = 0; k < found && !duplicate; k++) {
+            double cosine = current.a * candidates[k].a + current.b * candidates[k].b + current.c * candidates[k].c;
+            double offset = cosine < 0 ? current.d + candidates[k].d : current.d - candidates[k].d;
+            duplicate = fabs(cosine) > 0.999 && fabs(offset) < coarsest.voxel_size;
+            if(duplicate && score > support[k]) {
+                candidates[k] = current;
+                support[k] = score;
+            }
+        }
+        if(duplicate)
+            continue;
+        int slot = found < wanted ? found++ : -1;
+        if(slot < 0) {
+            slot = 0;
+            for(int k = 1; k < wanted; k++) {
+                if(support[k] < support[slot])
+                    slot = k;
+            }
+            if(support[slot] >= score)
+                continue;
+        }
+        candidates[slot] = current;
+        support[slot] = score;
+    }
+
+    for(int level = int(pyramid.levels.size()) - 2; level >= 0; level--) {
+        const voxel_level &finer = pyramid.levels[level];
+        double threshold = max(finer.voxel_size, p);
+        double best = 0;
+        for(int k = 0; k < found; k++) {
+            candidates[k] = refine_candidate_on_level(finer, candidates[k], threshold);
+            support[k] = weighted_support(finer, candidates[k], threshold);
+            best = max(best, support[k]);
+        }
+        int kept = 0;
+        for(int k = 0; k < found; k++) {
+            if(2 * support[k] >= best) {
+                candidates[kept] = candidates[k];
+                support[kept++] = support[k];
+            }
+        }
+        found = kept;
+    }
+
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    inlier_mask consensus = allocate_inlier_mask(points_cloud.size(), context.arena);
+    inlier_mask scored = allocate_inlier_mask(points_cloud.size(), context.arena);
+    for(int k = 0; k < found; k++) {
+        clear_inlier_mask(scored);
+        long inliers = score_plane_with_mask(points_cloud, candidates[k], p, scored);
+        if(inliers > most_fitted.inliers) {
+            most_fitted = candidates[k];
+            most_fitted.inliers = inliers;
+            swap(consensus.words, scored.words);
+        }
+    }
+    plane_hypothesis refined = refine_plane(points_cloud, most_fitted, p, &consensus, options, context);
+    context.arena.reset();
+    return refined;
+}
+
+// Byte stream between the coordinator and one shard worker. Implementations must be created
+// before fork() so both processes share them.
+class shard_transport {
+    public:
+        virtual ~shard_transport() {}
+        virtual void send(const void *data, size_t bytes) = 0;
+        virtual void receive(void *data, size_t bytes) = 0;
+        // called in each process after fork() to drop the other side's resources
+        virtual void becomeCoordinator(pid_t) {}
+        virtual void becomeWorker() {}
+};
+
+// A connected AF_UNIX stream socket pair.
+class socket_transport : public shard_transport {
+    public:
+        socket_transport();
+        ~socket_transport();
+        void send(const void*, size_t);
+        void receive(void*, size_t);
+        void becomeCoordinator(pid_t);
+        void becomeWorker();
+
+    private:
+        int fds_[2];
+        int own_;
+};
+
+socket_transport::socket_transport() : own_(-1)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds_) != 0)
+        throw runtime_error("Error: cannot create a socket pair for a shard worker.");
+}
+
+socket_transport::~socket_transport()
+{
+    if (own_ >= 0) {
+        close(own_);
+    } else {
+        close(fds_[0]);
+        close(fds_[1]);
+    }
+}
+
+void socket_transport::becomeCoordinator(pid_t)
+{
+    close(fds_[1]);
+    own_ = fds_[0];
+}
+
+void socket_transport::becomeWorker()
+{
+    close(fds_[0]);
+    own_ = fds_[1];
+}
+
+void socket_transport::send(const void *data, size_t bytes)
+{
+    const char *from = static_cast<const char*>(data);
+    while (bytes > 0) {
+        // a dead peer is an error here, not a SIGPIPE
+        ssize_t sent = ::send(own_, from, bytes, MSG_NOSIGNAL);
+        if (sent <= 0)
+            throw runtime_error("Error: shard transport closed while sending.");
+        from += sent;
+        bytes -= sent;
+    }
+}
+
+void socket_transport::receive(void *data, size_t bytes)
+{
+    char *to = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t got = read(own_, to, bytes);
+        if (got <= 0)
+            throw runtime_error("Error: shard transport closed while receiving.");
+        to += got;
+        bytes -= got;
+    }
+}
+
+// Two single-slot mailboxes in an anonymous shared mapping, one per direction, handed over
+// with process-shared semaphores. Messages larger than a slot go through in pieces. A semaphore
+// has no notion of a dead peer, so every wait times out periodically to check the other process.
+class shared_memory_transport : public shard_transport {
+    public:
+        explicit shared_memory_transport(size_t slot = 1 << 20);
+        ~shared_memory_transport();
+        void send(const void*, size_t);
+        void receive(void*, size_t);
+        void becomeCoordinator(pid_t worker) { worker_ = false; peer_ = worker; }
+        void becomeWorker() { worker_ = true; peer_ = getppid(); }
+
+    private:
+        struct mailbox {
+            sem_t full;
+            sem_t empty;
+            size_t bytes;
+        };
+
+        size_t slot_;
+        char *mapping_;
+        bool worker_;
+        pid_t peer_;
+
+        void wait(sem_t *semaphore);
+        bool peerAlive();
+
+        // direction 0 carries coordinator -> worker, direction 1 worker -> coordinator
+        mailbox* box(int direction) { return reinterpret_cast<mailbox*>(mapping_ + direction * (sizeof(mailbox) + slot_)); }
+        char* payload(int direction) { return reinterpret_cast<char*>(box(direction) + 1); }
+};
+
+shared_memory_transport::shared_memory_transport(size_t slot) : slot_(slot), worker_(false), peer_(-1)
+{
+    void *mapping = mmap(0, 2 * (sizeof(mailbox) + slot_), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        throw runtime_error("Error: cannot map shared memory for a shard worker.");
+    mapping_ = static_cast<char*>(mapping);
+    for (int direction = 0; direction < 2; ++direction) {
+        if (sem_init(&box(direction)->full, 1, 0) != 0 || sem_init(&box(direction)->empty, 1, 1) != 0) {
+            munmap(mapping_, 2 * (sizeof(mailbox) + slot_));
+            throw runtime_error("Error: cannot create the semaphores of a shard worker.");
+        }
+    }
+}
+
+shared_memory_transport::~shared_memory_transport()
+{
+    munmap(mapping_, 2 * (sizeof(mailbox) + slot_));
+}
+
+// The coordinator looks at its worker without reaping it, so fit_plane_sharded still gets the
+// exit status; a worker whose coordinator died has been reparented.
+bool shared_memory_transport::peerAlive()
+{
+    if (worker_)
+        return getppid() == peer_;
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, peer_, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+}
+
+void shared_memory_transport::wait(sem_t *semaphore)
+{
+    for (;;) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (sem_timedwait(semaphore, &deadline) == 0)
+            return;
+        if (errno != ETIMEDOUT && errno != EINTR)
+            throw runtime_error("Error: shard transport semaphore failed.");
+        if (!peerAlive())
+            throw runtime_error("Error: the other end of a shard transport has exited.");
+    }
+}
+
+void shared_memory_transport::send(const void *data, size_t bytes)
+{
+    int direction = worker_ ? 1 : 0;
+    mailbox *out = box(direction);
+    const char *from = static_cast<const char*>(data);
+    do {
+        size_t piece = min(bytes, slot_);
+        wait(&out->empty);
+        memcpy(payload(direction), from, piece);
+        out->bytes = piece;
+        sem_post(&out->full);
+        from += piece;
+        bytes -= piece;
+    } while (bytes > 0);
+}
+
+void shared_memory_transport::receive(void *data, size_t bytes)
+{
+    int direction = worker_ ? 0 : 1;
+    mailbox *in = box(direction);
+    char *to = static_cast<char*>(data);
+    do {
+        wait(&in->full);
+        size_t piece = in->bytes;
+        memcpy(to, payload(direction), piece);
+        sem_post(&in->empty);
+        to += piece;
+        bytes -= piece;
+    } while (bytes > 0);
+}
+
+enum transport_kind { TRANSPORT_SOCKET, TRANSPORT_SHARED_MEMORY };
+
+enum shard_command { SHARD_SAMPLE, SHARD_SCORE, SHARD_STOP };
+
+struct shard_message
+{
+    uint32_t command;
+    uint32_t count;
+    uint64_t seed;
+};
+
+// What a worker reports for one hypothesis: its local consensus size and the moments of it.
+struct shard_score
+{
+    long inliers;
+    plane_moments moments;
+};
+
+// Loads the points whose lines start inside the shard-th of `shards` equal byte ranges of the
+// data section, so every line belongs to exactly one shard. Only that range and the rest of its
+// last line are read.
+void read_shard(const string &path_to_file, int shard, int shards, vector<point3d> &points){
+    ifstream read(path_to_file, ios::binary);
+    string header;
+    getline(read, header);
+    getline(read, header);
+    streamoff data_start = read.tellg();
+    read.clear();
+    read.seekg(0, ios::end);
+    streamoff size = read.tellg();
+    if(data_start < 0 || size <= data_start)
+        return;
+    streamoff begin = data_start + (size - data_start) * shard / shards;
+    streamoff end = data_start + (size - data_start) * (shard + 1) / shards;
+
+    // start one byte early to see whether `begin` is a line start, and read on past `end` to finish the last line
+    streamoff from = begin > data_start ? begin - 1 : begin;
+    read.seekg(from);
+    string buffer;
+    buffer.resize(end - from);
+    read.read(&buffer[0], buffer.size());
+    buffer.resize(read.gcount());
+    char next_char;
+    while(!buffer.empty() && buffer.back() != '\n' && read.get(next_char))
+        buffer.push_back(next_char);
+
+    string::size_type position = 0;
+    if(begin > data_start) {
+        position = buffer.find('\n');
+        position = position == string::npos ? buffer.size() : position + 1;
+    }
+    while(position < buffer.size() && from + streamoff(position) < end) {
+        string::size_type line_end = buffer.find('\n', position);
+        if(line_end == string::npos)
+            line_end = buffer.size();
+        const char *cursor = buffer.c_str() + position;
+        char *next;
+        point3d point;
+        point.x = strtod(cursor, &next);
+        bool parsed = next != cursor;
+        cursor = next;
+        point.y = strtod(cursor, &next);
+        parsed = parsed && next != cursor;
+        cursor = next;
+        point.z = strtod(cursor, &next);
+        if(parsed && next != cursor)
+            points.push_back(point);
+        position = line_end + 1;
+    }
+}
+
+// Worker side: loads its shard, then answers coordinator requests until told to stop.
+void run_shard_worker(const string &path_to_file, int shard, int shards, double p, shard_transport &transport){
+    vector<point3d> points;
+    read_shard(path_to_file, shard, shards, points);
+    vector<plane_hypothesis> hypotheses;
+    vector<shard_score> scores;
+    for(;;) {
+        shard_message message;
+        transport.receive(&message, sizeof(message));
+        if(message.command == SHARD_STOP)
+            return;
+        if(message.command == SHARD_SAMPLE) {
+            hypotheses.clear();
+            if(points.size() >= 3) {
+                mt19937_64 random(message.seed);
+                uniform_int_distribution<vector<point3d>::size_type> first(0, points.size() - 3);
+                for(uint32_t h = 0; h < message.count; h++) {
+                    plane_hypothesis hypothesis = make_hypothesis(points, first(random));
+                    if(!hypothesis.degenerate)
+                        hypotheses.push_back(hypothesis);
+                }
+            }
+            uint32_t count = hypotheses.size();
+            transport.send(&count, sizeof(count));
+            transport.send(hypotheses.data(), count * sizeof(plane_hypothesis));
+        } else {
+            hypotheses.resize(message.count);
+            transport.receive(hypotheses.data(), message.count * sizeof(plane_hypothesis));
+            scores.assign(message.count, shard_score());
+            for(uint32_t h = 0; h < message.count; h++) {
+                // true distances; a triplet's normal has an arbitrary length
+                plane_hypothesis plane = normalize_plane(hypotheses[h]);
+                shard_score &score = scores[h];
+                for(vector<point3d>::size_type i = 0; i < points.size(); i++) {
+                    if(fabs(plane.a * points[i].x + plane.b * points[i].y + plane.c * points[i].z + plane.d) <= p) {
+                        score.inliers++;
+                        add_point_to_moments(score.moments, points[i]);
+                    }
+                }
+            }
+            transport.send(scores.data(), scores.size() * sizeof(shard_score));
+        }
+    }
+}
+
+// Coordinator side of the sharded search. `shards` forked workers each load a byte range of the
+// file. Per batch, every worker proposes shard_batch_size triplet planes from its own points;
+// the union is broadcast, every worker scores it against its shard and returns only inlier
+// counts and moment sums. The plane with the largest total consensus is refined by solving the
+// 3x3 normal equations of its merged moments. p is read from the file header.
+plane_hypothesis fit_plane_sharded(const string &path_to_file, int shards, transport_kind transport, const fit_options &options,
+                                   double &p){
+    int number_of_points = 0;
+    {
+        ifstream read(path_to_file);
+        read >> p;
+        read >> number_of_points;
+        if(!read)
+            throw runtime_error("Error: cannot read the header of " + path_to_file + ".");
+    }
+
+    vector<shard_transport*> channels;
+    vector<pid_t> workers;
+    plane_hypothesis most_fitted = {0, 0, 0, 0, 0, true};
+    plane_moments best_moments = plane_moments();
+    try {
+        for(int shard = 0; shard < shards; shard++) {
+            if(transport == TRANSPORT_SHARED_MEMORY)
+                channels.push_back(new shared_memory_transport());
+            else
+                channels.push_back(new socket_transport());
+        }
+        cout.flush();
+        for(int shard = 0; shard < shards; shard++) {
+            pid_t pid = fork();
+            if(pid < 0)
+                throw runtime_error("Error: cannot start a shard worker.");
+            if(pid == 0) {
+                channels[shard]->becomeWorker();
+                int status = 0;
+                try {
+                    run_shard_worker(path_to_file, shard, shards, p, *channels[shard]);
+                } catch(const exception &error) {
+                    cerr << error.what() << endl;
+                    status = 1;
+                }
+                _exit(status);
+            }
+            workers.push_back(pid);
+            channels[shard]->becomeCoordinator(pid);
+        }
+
+        vector<plane_hypothesis> batch;
+        vector<shard_score> totals, part;
+        for(int round = 0; round < options.shard_batches; round++) {
+            batch.clear();
+            for(int shard = 0; shard < shards; shard++) {
+                shard_message message = {SHARD_SAMPLE, uint32_t(options.shard_batch_size),
+                                         uint64_t(options.seed) * 1000003 + round * shards + shard};
+                channels[shard]->send(&message, sizeof(message));
+            }
+            for(int shard = 0; shard < shards; shard++) {
+                uint32_t count = 0;
+                channels[shard]->receive(&count, sizeof(count));
+                vector<plane_hypothesis>::size_type offset = batch.size();
+                batch.resize(offset + count);
+                channels[shard]->receive(batch.data() + offset, count * sizeof(plane_hypothesis));
+            }
+
+            shard_message score = {SHARD_SCORE, uint32_t(batch.size()), 0};
+            for(int shard = 0; shard < shards; shard++) {
+                channels[shard]->send(&score, sizeof(score));
+                channels[shard]->send(batch.data(), batch.size() * sizeof(plane_hypothesis));
+            }
+            totals.assign(batch.size(), shard_score());
+            part.resize(batch.size());
+            for(int shard = 0; shard < shards; shard++) {
+                channels[shard]->receive(part.data(), part.size() * sizeof(shard_score));
+                for(vector<shard_score>::size_type h = 0; h < part.size(); h++) {
+                    totals[h].inliers += part[h].inliers;
+                    merge_moments(totals[h].moments, part[h].moments);
+                }
+            }
+            for(vector<shard_score>::size_type h = 0; h < totals.size(); h++) {
+                if(totals[h].inliers > most_fitted.inliers) {
+                    most_fitted = batch[h];
+                    most_fitted.inliers = totals[h].inliers;
+                    best_moments = totals[h].moments;
+                }
+            }
+        }
+
+        shard_message stop = {SHARD_STOP, 0, 0};
+        for(int shard = 0; shard < shards; shard++)
+            channels[shard]->send(&stop, sizeof(stop));
+    } catch(...) {
+        // a worker that died ends the fit, and the others must not outlive it
+        for(vector<pid_t>::size_type shard = 0; shard < workers.size(); shard++)
+            kill(workers[shard], SIGKILL);
+        for(vector<pid_t>::size_type shard = 0; shard < workers.size(); shard++)
+            waitpid(workers[shard], 0, 0);
+        for(vector<shard_transport*>::size_type shard = 0; shard < channels.size(); shard++)
+            delete channels[shard];
+        throw;
+    }
+    int failed = 0;
+    for(int shard = 0; shard < shards; shard++) {
+        int status = 0;
+        if(waitpid(workers[shard], &status, 0) != workers[shard] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+        delete channels[shard];
+    }
+    if(failed > 0)
+        throw runtime_error("Error: " + to_string(failed) + " shard worker(s) did not finish cleanly.");
+    if(most_fitted.inliers == 0)
+        return most_fitted;
+    return plane_from_moments_any(best_moments, most_fitted.inliers);
+}
+
+// Per-point labels for the fitted planes: the id of the nearest plane, the signed distance to
+// it and whether that distance is within p. Points within p of no plane get id -1 (the
+// residual is still the one to the nearest plane). When `segments` holds the labels of a region
+// growing search, they are kept as they are and the residual is the one to the point's region.
+// The outputs may point into a mapped file.
+void label_points(const vector<point3d> &points_cloud, const vector<plane_hypothesis> &planes, double p, const int *segments,
+                  int32_t *plane_ids, double *residuals, uint8_t *inliers, scratch_arena &arena){
+    vector<point3d>::size_type n = points_cloud.size();
+    double *current = arena.allocate_array<double>(n);
+    for(vector<plane_hypothesis>::size_type k = 0; k < planes.size(); k++) {
+        plane_residuals(points_cloud, planes[k], RESIDUAL_SIGNED, k == 0 ? residuals : current);
+        if(k == 0) {
+            for(vector<point3d>::size_type i = 0; i < n; i++)
+                plane_ids[i] = 0;
+            continue;
+        }
+        for(vector<point3d>::size_type i = 0; i < n; i++) {
+            bool closer = fabs(current[i]) < fabs(residuals[i]);
+            residuals[i] = closer ? current[i] : residuals[i];
+            plane_ids[i] = closer ? int32_t(k) : plane_ids[i];
+        }
+    }
+    if(segments) {
+        plane_hypothesis *units = arena.allocate_array<plane_hypothesis>(planes.size());
+        for(vector<plane_hypothesis>::size_type k = 0; k < planes.size(); k++)
+            units[k] = normalize_plane(planes[k]);
+        for(vector<point3d>::size_type i = 0; i < n; i++) {
+            inliers[i] = segments[i] >= 0 && segments[i] < int(planes.size());
+            plane_ids[i] = inliers[i] ? segments[i] : -1;
+            if(inliers[i]) {
+                const plane_hypothesis &unit = units[segments[i]];
+                const point3d &q = points_cloud[i];
+                residuals[i] = unit.a * q.x + unit.b * q.y + unit.c * q.z + unit.d;
+            }
+        }
+        return;
+    }
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        inliers[i] = fabs(residuals[i]) <= p;
+        plane_ids[i] = inliers[i] ? plane_ids[i] : -1;
+    }
+}
+
+// Text labels, one "plane_id residual inlier" line per point in input order. Numbers are
+// formatted with to_chars into a large buffer that is written out whenever it fills up.
+void write_labels_text(const string &path, const int32_t *plane_ids, const double *residuals, const uint8_t *inliers,
+                       vector<point3d>::size_type n){
+    ofstream write(path, ios::binary);
+    const size_t capacity = 1 << 20;
+    vector<char> buffer(capacity);
+    char *end = buffer.data() + capacity;
+    char *cursor = buffer.data();
+    for(vector<point3d>::size_type i = 0; i < n; i++) {
+        // plane id, residual, inlier flag, separators
+        if(size_t(end - cursor) < FIXED6_MAX_CHARS + 16) {
+            write.write(buffer.data(), cursor - buffer.data());
+            cursor = buffer.data();
+        }
+        cursor = to_chars(cursor, end, plane_ids[i]).ptr;
+        *cursor++ = ' ';
+        to_chars_result written = to_chars(cursor, end, residuals[i], chars_format::fixed, 6);
+        if(written.ec != errc())
+            throw runtime_error("Error: cannot format the residual of point " + to_string(i) + ".");
+        cursor = written.ptr;
+        *cursor++ = ' ';
+        *cursor++ = inliers[i] ? '1' : '0';
+        *cursor++ = '\n';
+    }
+    write.write(buffer.data(), cursor - buffer.data());
+    if(!write)
+        throw runtime_error("Error: cannot write labels to " + path + ".");
+}
+
+// Binary column file: a 16-byte header ("PLBL", uint32 version 1, uint64 point count), then
+// double residuals[n], int32 plane_ids[n] and uint8 inliers[n]. The file is sized up front
+// and mapped, and label_points writes the columns straight into the mapping.
+void write_labels_binary(const string &path, const vector<point3d> &points_cloud, const vector<plane_hypothesis> &planes,
+                         double p, const int *segments, scratch_arena &arena){
+    uint64_t n = points_cloud.size();
+    size_t size = 16 + n * (sizeof(double) + sizeof(int32_t) + sizeof(uint8_t));
+    FILE *file = fopen(path.c_str(), "w+b");
+    if(!file)
+        throw runtime_error("Error: cannot create " + path + ".");
+    if(ftruncate(fileno(file), size) != 0) {
+        fclose(file);
+        throw runtime_error("Error: cannot resize " + path + ".");
+    }
+    void *mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    fclose(file);
+    if(mapping == MAP_FAILED)
+        throw runtime_error("Error: cannot map " + path + ".");
+    char *bytes = static_cast<char*>(mapping);
+    uint32_t version = 1;
+    memcpy(bytes, "PLBL", 4);
+    memcpy(bytes + 4, &version, 4);
+    memcpy(bytes + 8, &n, 8);
+    double *residuals = reinterpret_cast<double*>(bytes + 16);
+    int32_t *plane_ids = reinterpret_cast<int32_t*>(residuals + n);
+    uint8_t *inliers = reinterpret_cast<uint8_t*>(plane_ids + n);
+    label_points(points_cloud, planes, p, segments, plane_ids, residuals, inliers, arena);
+    munmap(mapping, size);
+}
+
+// Region-growing labels from the last fit are used when the context holds them for this cloud.
+void write_point_labels(const string &path, bool binary, const vector<point3d> &points_cloud,
+                        const vector<plane_hypothesis> &planes, double p, fit_context &context){
+    const int *segments = context.labels.size() == points_cloud.size() ? context.labels.data() : 0;
+    if(binary) {
+        write_labels_binary(path, points_cloud, planes, p, segments, context.arena);
+    } else {
+        vector<point3d>::size_type n = points_cloud.size();
+        int32_t *plane_ids = context.arena.allocate_array<int32_t>(n);
+        double *residuals = context.arena.allocate_array<double>(n);
+        uint8_t *inliers = context.arena.allocate_array<uint8_t>(n);
+        label_points(points_cloud, planes, p, segments, plane_ids, residuals, inliers, context.arena);
+        write_labels_text(path, plane_ids, residuals, inliers, n);
+    }
+    context.arena.reset();
+}
+
+// --check-solvers: solves banded and sparse systems with a known solution and reports the
+// largest error of each solver; returns 1 if any of them misses.
+int check_solvers(){
+    mt19937_64 random(1);
+    uniform_real_distribution<double> value(-1, 1);
+    const int n = 20000, lower = 2, upper = 3;
+    vector<double> truth(n);
+    for(int i = 0; i < n; i++)
+        truth[i] = value(random);
+
+    BandMatrix band(n, lower, upper);
+    for(int i = 0; i < n; i++) {
+        for(int j = max(0, i - lower); j <= min(n - 1, i + upper); j++)
+            band(i, j) = i == j ? lower + upper + 1 : value(random);
+    }
+    vector<double> b(n, 0.0);
+    for(int i = 0; i < n; i++) {
+        for(int j = max(0, i - lower); j <= min(n - 1, i + upper); j++)
+            b[i] += band.at(i, j) * truth[j];
+    }
+    Matrix columns(n, 2);
+    for(int i = 0; i < n; i++) {
+        columns(i, 0) = b[i];
+        columns(i, 1) = 2 * b[i];
+    }
+    band.factorize();
+    band.solveInPlace(b);
+    Matrix solved = band.solve(columns);
+    double band_error = 0;
+    for(int i = 0; i < n; i++) {
+        band_error = max(band_error, fabs(b[i] - truth[i]));
+        band_error = max(band_error, max(fabs(solved(i, 0) - truth[i]), fabs(solved(i, 1) - 2 * truth[i])));
+    }
+
+    // three nonzeros per row, three times as many rows as unknowns
+    SparseMatrix design(3 * n, n);
+    for(int i = 0; i < 3 * n; i++) {
+        design.add(i, i / 3, 2);
+        design.add(i, (i * 7 + 1) % n, value(random));
+        design.add(i, (i * 13 + 5) % n, value(random));
+    }
+    design.compress();
+    vector<double> observed(3 * n), rhs(n);
+    design.multiply(truth, observed);
+    design.multiplyTransposed(observed, rhs);
+    vector<double> least_squares = SparseMatrix::solveNormalEquations(design, observed, 1000, 1e-12);
+    vector<double> conjugate = SparseMatrix::conjugateGradient(design.transposeTimesSelf(), rhs, 1000, 1e-12);
+    double sparse_error = 0;
+    for(int i = 0; i < n; i++)
+        sparse_error = max(sparse_error, max(fabs(least_squares[i] - truth[i]), fabs(conjugate[i] - truth[i])));
+
+    cout << "BandMatrix " << n << "x" << n << " (" << lower << " below, " << upper << " above): max error " << band_error << endl;
+    cout << "SparseMatrix " << 3 * n << "x" << n << " least squares and CG: max error " << sparse_error << endl;
+    return band_error < 1e-9 && sparse_error < 1e-6 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]){
+    int number_of_points = 0;
+    double p = 0;
+    vector<point3d> points_cloud;
+    string path_to_file = "input.txt";
+    string path_to_output = "output.txt";
+    bool pipelined = false;
+    int benchmark_runs = 0;
+    int shards = 0;
+    string path_to_labels;
+    bool binary_labels = false;
+    transport_kind transport = TRANSPORT_SOCKET;
+    fit_options options;
+    bool refine_given = false;
+    for(int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if(argument == "--check-solvers") {
+            return check_solvers();
+        } else if(argument == "--pipelined") {
+            pipelined = true;
+        } else if(argument == "--benchmark" && i + 1 < argc) {
+            benchmark_runs = atoi(argv[++i]);
+        } else if(argument == "--refine" && i + 1 < argc) {
+            string mode = argv[++i];
+            refine_given = true;
+            if(mode == "half") {
+                options.refinement = REFINE_CLOSEST_HALF;
+            } else if(mode == "inliers") {
+                options.refinement = REFINE_INLIER_MASK;
+            } else if(mode == "huber") {
+                options.refinement = REFINE_HUBER;
+            } else if(mode == "tukey") {
+                options.refinement = REFINE_TUKEY;
+            } else {
+                cerr << "Unknown refinement mode: " << mode << endl;
+                return 1;
+            }
+        } else if(argument == "--pyramid" && i + 1 < argc) {
+            options.pyramid_levels = atoi(argv[++i]);
+        } else if(argument == "--voxel" && i + 1 < argc) {
+            options.voxel_size = atof(argv[++i]);
+        } else if(argument == "--engine" && i + 1 < argc) {
+            string engine = argv[++i];
+            if(engine == "triplets") {
+                options.engine = ENGINE_TRIPLETS;
+            } else if(engine == "hough") {
+                options.engine = ENGINE_HOUGH;
+            } else if(engine == "regions") {
+                options.engine = ENGINE_REGIONS;
+            } else {
+                cerr << "Unknown search engine: " << engine << endl;
+                return 1;
+            }
+        } else if(argument == "--samples" && i + 1 < argc) {
+            options.hough_samples = atol(argv[++i]);
+        } else if(argument == "--neighbors" && i + 1 < argc) {
+            options.region_neighbors = atoi(argv[++i]);
+        } else if(argument == "--angle" && i + 1 < argc) {
+            options.region_angle = atof(argv[++i]);
+        } else if(argument == "--shards" && i + 1 < argc) {
+            shards = atoi(argv[++i]);
+        } else if(argument == "--transport" && i + 1 < argc) {
+            string kind = argv[++i];
+            if(kind == "socket") {
+                transport = TRANSPORT_SOCKET;
+            } else if(kind == "shm") {
+                transport = TRANSPORT_SHARED_MEMORY;
+            } else {
+                cerr << "Unknown transport: " << kind << endl;
+                return 1;
+            }
+        } else if(argument == "--labels" && i + 1 < argc) {
+            path_to_labels = argv[++i];
+        } else if(argument == "--binary-labels") {
+            binary_labels = true;
+        } else if(argument == "--input" && i + 1 < argc) {
+            path_to_file = argv[++i];
+        } else if(argument == "--output" && i + 1 < argc) {
+            path_to_output = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--input file] [--output file] [--pipelined] [--refine half|inliers|huber|tukey]"
+                 << " [--engine triplets|hough|regions [--samples n] [--neighbors k] [--angle degrees]]"
+                 << " [--pyramid levels [--voxel size]] [--shards workers [--transport socket|shm]]"
+                 << " [--labels file [--binary-labels]]"
+                 << " [--benchmark runs] [--check-solvers]" << endl;
+            return 1;
+        }
+    }
+
+    if(refine_given && options.engine != ENGINE_TRIPLETS) {
+        cerr << "--engine hough and regions fit each plane on its own inliers and cannot be combined with --refine" << endl;
+        return 1;
+    }
+    if(options.pyramid_levels > 0 && options.engine != ENGINE_TRIPLETS) {
+        cerr << "--pyramid runs the triplet search and cannot be combined with --engine" << endl;
+        return 1;
+    }
+    if(options.region_neighbors < 3) {
+        cerr << "--neighbors must be at least 3, a normal is estimated from the neighbourhood" << endl;
+        return 1;
+    }
+    if(pipelined && (options.pyramid_levels > 0 || options.engine != ENGINE_TRIPLETS)) {
+        cerr << "--pipelined runs the triplet search and cannot be combined with --pyramid or --engine" << endl;
+        return 1;
+    }
+
+    if(shards > 0 && (pipelined || refine_given || options.pyramid_levels > 0 || options.engine != ENGINE_TRIPLETS)) {
+        cerr << "--shards runs its own triplet search and moment refinement and cannot be combined with"
+             << " --pipelined, --refine, --pyramid or --engine" << endl;
+        return 1;
+    }
+    if((pipelined || shards > 0) && is_binary_cloud(path_to_file)) {
+        cerr << "--pipelined and --shards stream the text format; binary clouds are only read whole" << endl;
+        return 1;
+    }
+
+    // a cloud the fit cannot handle ends the run with the reason instead of an abort
+    try {
+        fit_context context;
+        voxel_pyramid pyramid;
+        // built once below and reused by every fit on the same cloud
+        auto fit_loaded_cloud = [&]() {
+            if(options.pyramid_levels > 0)
+                return fit_plane_coarse_to_fine(points_cloud, pyramid, p, options, context);
+            return fit_plane(points_cloud, p, options, context);
+        };
+        plane_hypothesis plane;
+        if(shards > 0) {
+            // the workers load the file themselves; only the plane comes back
+            plane = fit_plane_sharded(path_to_file, shards, transport, options, p);
+        } else if(pipelined) {
+            ifstream read(path_to_file);
+            if(!read)
+                throw runtime_error("Error: cannot open " + path_to_file + ".");
+            if(!(read >> p >> number_of_points))
+                throw runtime_error("Error: cannot read the header of " + path_to_file + ".");
+            plane_hypothesis most_fitted = find_most_fitted_plane_pipelined(read, p, number_of_points,
+                                                                            refines_consensus_set(options.refinement),
+                                                                            points_cloud, context, cout);
+            plane = refine_plane(points_cloud, most_fitted, p, 0, options, context);
+            context.arena.reset();
+        } else {
+            read_file(path_to_file, p, number_of_points, points_cloud);
+            if(options.pyramid_levels > 0)
+                pyramid = build_voxel_pyramid(points_cloud, options.pyramid_levels, options.voxel_size);
+            plane = fit_loaded_cloud();
+        }
+
+        if(benchmark_runs > 0 && shards == 0) {
+            // the first fit above sized the arena; these should not allocate at all
+            long allocations_before = allocations_so_far();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for(int run = 0; run < benchmark_runs; run++)
+                plane = fit_loaded_cloud();
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            long allocations = allocations_so_far() - allocations_before;
+            cout << "Fits: " << benchmark_runs << ", mean time: " << elapsed / benchmark_runs << " s, arena: "
+                 << context.arena.capacity() << " bytes, heap allocations: ";
+            if(allocations_before < 0)
+                cout << "not counted (build with -DCOUNT_ALLOCATIONS)" << endl;
+            else
+                cout << allocations << endl;
+        }
+
+        ofstream write(path_to_output);
+        write.precision(6);
+        write<<fixed<<plane.a<<" "<<plane.b<<" "<<plane.c<<" "<<plane.d;
+
+        if(!path_to_labels.empty()) {
+            if(shards > 0)
+                read_file(path_to_file, p, number_of_points, points_cloud);
+            // plane 0 is the result, the others are the rest of a multi-plane search
+            vector<plane_hypothesis> planes(1, plane);
+            if(context.detected.size() > 1)
+                planes.insert(planes.end(), context.detected.begin() + 1, context.detected.end());
+            write_point_labels(path_to_labels, binary_labels, points_cloud, planes, p, context);
+        }
+    } catch(const exception &error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
 
     return 0;
 }
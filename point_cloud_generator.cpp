@@ -0,0 +1,190 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <math.h>
+#include <random>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <charconv>
+#include <system_error>
+#include <cstring>
+#include <algorithm>
+
+#include "fixed_notation.h"
+
+using namespace std;
+
+// Synthetic scenes with known planes for plane_reconstruction_final. Writes the usual
+// "p / count / x y z" text (no trailing newline, like input.txt) or, with --binary, the
+// PLCD format: "PLCD", uint32 version 1, double p, uint64 count, then count x,y,z doubles.
+// The true planes go to --truth as "a b c d x y z" lines: a unit normal, the offset and the
+// centre of the generated patch.
+
+struct plane_patch
+{
+    double normal[3];
+    double u[3];
+    double v[3];
+    double centre[3];
+};
+
+void cross(const double l[3], const double r[3], double out[3]){
+    out[0] = l[1] * r[2] - l[2] * r[1];
+    out[1] = l[2] * r[0] - l[0] * r[2];
+    out[2] = l[0] * r[1] - l[1] * r[0];
+}
+
+void normalize(double v[3]){
+    double length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    for(int i = 0; i < 3; i++)
+        v[i] /= length;
+}
+
+// Tilted planes are kept within 60 degrees of horizontal; vertical ones have a zero z normal.
+plane_patch random_patch(mt19937_64 &random, bool vertical, double scene){
+    uniform_real_distribution<double> unit(0, 1);
+    uniform_real_distribution<double> position(-scene / 2, scene / 2);
+    plane_patch patch;
+    double azimuth = 2 * M_PI * unit(random);
+    double tilt = vertical ? M_PI / 2 : acos(1 - unit(random) * 0.5);
+    patch.normal[0] = sin(tilt) * cos(azimuth);
+    patch.normal[1] = sin(tilt) * sin(azimuth);
+    patch.normal[2] = vertical ? 0 : cos(tilt);
+    normalize(patch.normal);
+    double helper[3] = {0, 0, 1};
+    if(fabs(patch.normal[2]) > 0.9) {
+        helper[0] = 1;
+        helper[2] = 0;
+    }
+    cross(patch.normal, helper, patch.u);
+    normalize(patch.u);
+    cross(patch.normal, patch.u, patch.v);
+    for(int i = 0; i < 3; i++)
+        patch.centre[i] = position(random);
+    return patch;
+}
+
+int main(int argc, char *argv[]){
+    long long number_of_points = 100000;
+    int planes = 1;
+    int vertical = 0;
+    double sigma = 0.01;
+    double outliers = 0.2;
+    double p = -1;
+    double scene = 100;
+    double patch_size = 40;
+    unsigned long long seed = 1;
+    bool binary = false;
+    string path_to_output = "synthetic.txt";
+    string path_to_truth;
+    for(int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if(argument == "--points" && i + 1 < argc) {
+            number_of_points = atoll(argv[++i]);
+        } else if(argument == "--planes" && i + 1 < argc) {
+            planes = atoi(argv[++i]);
+        } else if(argument == "--vertical" && i + 1 < argc) {
+            vertical = atoi(argv[++i]);
+        } else if(argument == "--noise" && i + 1 < argc) {
+            sigma = atof(argv[++i]);
+        } else if(argument == "--outliers" && i + 1 < argc) {
+            outliers = atof(argv[++i]);
+        } else if(argument == "--p" && i + 1 < argc) {
+            p = atof(argv[++i]);
+        } else if(argument == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], 0, 10);
+        } else if(argument == "--binary") {
+            binary = true;
+        } else if(argument == "--output" && i + 1 < argc) {
+            path_to_output = argv[++i];
+        } else if(argument == "--truth" && i + 1 < argc) {
+            path_to_truth = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--points n] [--planes k] [--vertical k] [--noise sigma] [--outliers ratio]"
+                 << " [--p threshold] [--seed s] [--binary] [--output file] [--truth file]" << endl;
+            return 1;
+        }
+    }
+    if(planes < 1 || vertical > planes || number_of_points < 3 || outliers < 0 || outliers >= 1) {
+        cerr << "Need at least one plane, no more vertical planes than planes, 3 points and an outlier ratio in [0, 1)" << endl;
+        return 1;
+    }
+    if(p < 0)
+        p = max(3 * sigma, 0.05);
+
+    mt19937_64 random(seed);
+    vector<plane_patch> patches;
+    for(int k = 0; k < planes; k++)
+        patches.push_back(random_patch(random, k < vertical, scene));
+    if(!path_to_truth.empty()) {
+        ofstream truth(path_to_truth);
+        truth.precision(9);
+        for(int k = 0; k < planes; k++) {
+            const plane_patch &patch = patches[k];
+            double d = -(patch.normal[0] * patch.centre[0] + patch.normal[1] * patch.centre[1] + patch.normal[2] * patch.centre[2]);
+            truth << patch.normal[0] << " " << patch.normal[1] << " " << patch.normal[2] << " " << d << " "
+                  << patch.centre[0] << " " << patch.centre[1] << " " << patch.centre[2] << endl;
+        }
+    }
+
+    ofstream write(path_to_output, ios::binary);
+    if(binary) {
+        uint32_t version = 1;
+        uint64_t count = number_of_points;
+        write.write("PLCD", 4);
+        write.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        write.write(reinterpret_cast<const char*>(&p), sizeof(p));
+        write.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    } else {
+        write << p << "\n" << number_of_points;
+    }
+
+    // each point independently picks a plane or the outlier box, so the output is already shuffled
+    uniform_real_distribution<double> unit(0, 1);
+    uniform_real_distribution<double> across(-patch_size / 2, patch_size / 2);
+    uniform_real_distribution<double> box(-scene, scene);
+    uniform_int_distribution<int> which(0, planes - 1);
+    normal_distribution<double> noise(0, sigma > 0 ? sigma : 1);
+    const size_t capacity = 1 << 20;
+    vector<char> buffer(capacity);
+    char *end = buffer.data() + capacity;
+    char *cursor = buffer.data();
+    for(long long i = 0; i < number_of_points; i++) {
+        double point[3];
+        if(unit(random) < outliers) {
+            for(int c = 0; c < 3; c++)
+                point[c] = box(random);
+        } else {
+            const plane_patch &patch = patches[which(random)];
+            double s = across(random), t = across(random), e = sigma > 0 ? noise(random) : 0;
+            for(int c = 0; c < 3; c++)
+                point[c] = patch.centre[c] + s * patch.u[c] + t * patch.v[c] + e * patch.normal[c];
+        }
+        // three coordinates and their separators
+        if(size_t(end - cursor) < 3 * (FIXED6_MAX_CHARS + 1)) {
+            write.write(buffer.data(), cursor - buffer.data());
+            cursor = buffer.data();
+        }
+        if(binary) {
+            memcpy(cursor, point, sizeof(point));
+            cursor += sizeof(point);
+        } else {
+            for(int c = 0; c < 3; c++) {
+                *cursor++ = c == 0 ? '\n' : '\t';
+                to_chars_result written = to_chars(cursor, end, point[c], chars_format::fixed, 6);
+                if(written.ec != errc()) {
+                    cerr << "Cannot format point " << i << endl;
+                    return 1;
+                }
+                cursor = written.ptr;
+            }
+        }
+    }
+    write.write(buffer.data(), cursor - buffer.data());
+    if(!write) {
+        cerr << "Cannot write " << path_to_output << endl;
+        return 1;
+    }
+    return 0;
+}
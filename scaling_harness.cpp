@@ -0,0 +1,227 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <math.h>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Scaling and accuracy sweep: generates clouds with point_cloud_generator, fits them with
+// plane_reconstruction_final and prints one CSV row per run with wall time, peak RSS of the
+// fitter, the angle between the fitted plane and the true plane it is closest to, and the
+// distance of the fitted plane from the centre of that true patch. Every scenario runs every
+// configuration (the shipped default and each --refine mode of both triplet searches, the
+// multi-plane engines, the text format, --pipelined and --shards), and the cloud is written
+// both as binary and as text.
+// Exits with 1 when the fitter's solver self-check fails, or when any run exits with an error or
+// misses either tolerance, so it can gate speed work on accuracy.
+
+struct scenario
+{
+    const char *name;
+    int planes;
+    int vertical;
+    double noise;
+    double outliers;
+};
+
+struct engine_setup
+{
+    const char *name;
+    vector<string> arguments;
+    long long max_points;   // the triplet search is quadratic, keep it to small clouds
+    bool text;              // reads the text format (--pipelined and --shards only stream text)
+};
+
+struct run_result
+{
+    int status;
+    double seconds;
+    long max_rss_kb;
+};
+
+// fork/exec so wait4 can report the child's own peak memory. The child's stdout goes to
+// stderr, so progress output (--pipelined) stays out of the CSV.
+run_result run(const vector<string> &command){
+    vector<char*> arguments;
+    for(const string &argument : command)
+        arguments.push_back(const_cast<char*>(argument.c_str()));
+    arguments.push_back(0);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    pid_t child = fork();
+    if(child == 0) {
+        dup2(2, 1);
+        execv(arguments[0], arguments.data());
+        _exit(127);
+    }
+    run_result result = {-1, 0, 0};
+    if(child < 0)
+        return result;
+    struct rusage usage;
+    int status = 0;
+    wait4(child, &status, 0, &usage);
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.max_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+// One plane per line: a b c d, optionally followed by more numbers (the truth file adds the patch centre).
+vector<vector<double>> read_planes(const string &path){
+    vector<vector<double>> planes;
+    ifstream read(path);
+    string line;
+    while(getline(read, line)) {
+        istringstream fields(line);
+        vector<double> plane;
+        double value;
+        while(fields >> value)
+            plane.push_back(value);
+        if(plane.size() >= 4)
+            planes.push_back(plane);
+    }
+    return planes;
+}
+
+struct plane_error
+{
+    double angle;    // degrees between the normals
+    double offset;   // distance of the fitted plane from the centre of the true patch
+};
+
+// Errors of `fitted` against the plane in `truth` that is closest to it, judged by angle and
+// offset together, so a parallel plane of a scene does not pass for the right one. The offset
+// is taken at the patch centre rather than the origin, where a small tilt would dominate it.
+plane_error compare_with_truth(const vector<double> &fitted, const vector<vector<double>> &truth){
+    plane_error best = {180, INFINITY};
+    double fitted_length = sqrt(fitted[0] * fitted[0] + fitted[1] * fitted[1] + fitted[2] * fitted[2]);
+    if(!(fitted_length > 0))
+        return best;
+    for(const vector<double> &plane : truth) {
+        if(plane.size() < 7)
+            continue;
+        double length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        double cosine = fabs(fitted[0] * plane[0] + fitted[1] * plane[1] + fitted[2] * plane[2]) / (fitted_length * length);
+        double distance = fitted[0] * plane[4] + fitted[1] * plane[5] + fitted[2] * plane[6] + fitted[3];
+        plane_error error = {acos(min(cosine, 1.0)) * 180 / M_PI, fabs(distance) / fitted_length};
+        if(error.angle + error.offset < best.angle + best.offset)
+            best = error;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]){
+    string generator = "./point_cloud_generator";
+    string fitter = "./plane_reconstruction_final";
+    string directory = "/tmp";
+    long long max_points = 100000;
+    double tolerance = 1.0;
+    double offset_tolerance = 0.1;
+    string seed = "1";
+    for(int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if(argument == "--generator" && i + 1 < argc) {
+            generator = argv[++i];
+        } else if(argument == "--fitter" && i + 1 < argc) {
+            fitter = argv[++i];
+        } else if(argument == "--dir" && i + 1 < argc) {
+            directory = argv[++i];
+        } else if(argument == "--max-points" && i + 1 < argc) {
+            max_points = atoll(argv[++i]);
+        } else if(argument == "--tolerance" && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if(argument == "--offset-tolerance" && i + 1 < argc) {
+            offset_tolerance = atof(argv[++i]);
+        } else if(argument == "--seed" && i + 1 < argc) {
+            seed = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--generator path] [--fitter path] [--dir scratch] [--max-points n]"
+                 << " [--tolerance degrees] [--offset-tolerance distance] [--seed s]" << endl;
+            return 1;
+        }
+    }
+
+    vector<scenario> scenarios = {
+        {"single", 1, 0, 0.01, 0.2},
+        {"vertical", 1, 1, 0.01, 0.2},
+        {"noisy", 1, 0, 0.05, 0.5},
+        {"scene", 4, 1, 0.02, 0.3},
+    };
+    // every refinement of both triplet searches, the multi-plane engines, and the text-only modes
+    vector<engine_setup> engines = {
+        {"triplets", {}, 20000, false},
+        {"triplets-inliers", {"--refine", "inliers"}, 20000, false},
+        {"triplets-huber", {"--refine", "huber"}, 20000, false},
+        {"triplets-tukey", {"--refine", "tukey"}, 20000, false},
+        {"triplets-text", {}, 20000, true},
+        {"pipelined", {"--pipelined"}, 20000, true},
+        {"pyramid", {"--pyramid", "3"}, 0, false},
+        {"pyramid-inliers", {"--pyramid", "3", "--refine", "inliers"}, 0, false},
+        {"pyramid-huber", {"--pyramid", "3", "--refine", "huber"}, 0, false},
+        {"pyramid-tukey", {"--pyramid", "3", "--refine", "tukey"}, 0, false},
+        {"hough", {"--engine", "hough"}, 0, false},
+        {"regions", {"--engine", "regions"}, 0, false},
+        {"shards-socket", {"--shards", "3"}, 0, true},
+        {"shards-shm", {"--shards", "3", "--transport", "shm"}, 0, true},
+    };
+    string cloud = directory + "/harness_cloud.bin";
+    string text_cloud = directory + "/harness_cloud.txt";
+    string truth = directory + "/harness_truth.txt";
+    string fitted = directory + "/harness_fitted.txt";
+
+    int failures = 0;
+    if(run({fitter, "--check-solvers"}).status != 0) {
+        cerr << fitter << " --check-solvers failed" << endl;
+        failures++;
+    }
+    cout << "scenario,engine,points,planes,vertical,noise,outliers,seconds,max_rss_kb,angle_error_deg,offset_error,result" << endl;
+    for(long long points = 1000; points <= max_points; points *= 10) {
+        for(const scenario &scene : scenarios) {
+            vector<string> generate = {generator, "--points", to_string(points), "--planes", to_string(scene.planes),
+                                       "--vertical", to_string(scene.vertical), "--noise", to_string(scene.noise),
+                                       "--outliers", to_string(scene.outliers), "--seed", seed, "--truth", truth};
+            // the same seed gives the same points in both formats
+            vector<string> generate_binary = generate, generate_text = generate;
+            generate_binary.insert(generate_binary.end(), {"--binary", "--output", cloud});
+            generate_text.insert(generate_text.end(), {"--output", text_cloud});
+            if(run(generate_binary).status != 0 || run(generate_text).status != 0) {
+                cerr << "Cannot run " << generator << endl;
+                return 1;
+            }
+            vector<vector<double>> truth_planes = read_planes(truth);
+            for(const engine_setup &engine : engines) {
+                if(engine.max_points > 0 && points > engine.max_points)
+                    continue;
+                vector<string> fit = {fitter, "--input", engine.text ? text_cloud : cloud, "--output", fitted};
+                fit.insert(fit.end(), engine.arguments.begin(), engine.arguments.end());
+                remove(fitted.c_str());
+                run_result result = run(fit);
+                vector<vector<double>> fitted_planes = read_planes(fitted);
+                plane_error error = {180, INFINITY};
+                if(result.status == 0 && !fitted_planes.empty())
+                    error = compare_with_truth(fitted_planes[0], truth_planes);
+                bool passed = result.status == 0 && error.angle <= tolerance && error.offset <= offset_tolerance;
+                failures += !passed;
+                cout << scene.name << "," << engine.name << "," << points << "," << scene.planes << "," << scene.vertical
+                     << "," << scene.noise << "," << scene.outliers << "," << result.seconds << "," << result.max_rss_kb
+                     << "," << error.angle << "," << error.offset << "," << (passed ? "ok" : "FAIL") << endl;
+            }
+        }
+    }
+    remove(cloud.c_str());
+    remove(text_cloud.c_str());
+    remove(truth.c_str());
+    remove(fitted.c_str());
+    if(failures > 0) {
+        cerr << failures << " checks failed (exit status, " << tolerance << " degrees or " << offset_tolerance
+             << " offset)" << endl;
+        return 1;
+    }
+    return 0;
+}